@@ -0,0 +1,272 @@
+/*
+    admission.c
+
+    Per source address token buckets. See admission.h.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <netinet/in.h>
+
+#include "admission.h"
+
+#define BUCKET_TIME(bucket) ((uint32_t)((bucket) >> 32))
+#define BUCKET_TOKENS(bucket) ((uint32_t)(bucket))
+#define BUCKET(time, tokens) (((uint64_t)(uint32_t)(time) << 32) | (uint32_t)(tokens))
+
+static uint64_t HashAddress(const uint8_t *address)
+{
+    uint64_t high, low;
+    memcpy(&high, address, sizeof(high));
+    memcpy(&low, address + 8, sizeof(low));
+
+    // splitmix64 finalizer over both halves.
+    uint64_t hash = high ^ (low * 0x9e3779b97f4a7c15ULL);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash && hash != ADMISSION_CLAIMING ? hash : 1;
+}
+
+ADMISSION_TABLE *AdmissionCreate(uint32_t connRate, uint32_t connBurst, uint32_t byteRate, uint32_t byteBurst)
+{
+    ADMISSION_TABLE *table = (ADMISSION_TABLE *)calloc(1, sizeof(ADMISSION_TABLE));
+    if (!table)
+        return NULL;
+
+    table->entries = (ADMISSION_ENTRY *)calloc(ADMISSION_TABLE_SIZE, sizeof(ADMISSION_ENTRY));
+    if (!table->entries)
+    {
+        free(table);
+        return NULL;
+    }
+    table->connRate = connRate;
+    // tokens are kept in milli-connections in 32 bits.
+    table->connBurst = connBurst == 0 ? 1 : connBurst > UINT32_MAX / 1000 ? UINT32_MAX / 1000 : connBurst;
+    table->byteRate = byteRate;
+    table->byteBurst = byteBurst > INT32_MAX ? INT32_MAX : byteBurst;
+    table->startMs = 0;
+    table->startMs = AdmissionNowMs(table);
+    return table;
+}
+
+void AdmissionFree(ADMISSION_TABLE *table)
+{
+    if (!table)
+        return;
+    free(table->entries);
+    free(table);
+}
+
+uint64_t AdmissionNowMs(ADMISSION_TABLE *table)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000 - table->startMs;
+}
+
+static void ResetEntry(ADMISSION_TABLE *table, ADMISSION_ENTRY *entry, uint64_t nowMs)
+{
+    atomic_store_explicit(&entry->connBucket, BUCKET(nowMs, (uint64_t)table->connBurst * 1000), memory_order_relaxed);
+    atomic_store_explicit(&entry->byteBucket, BUCKET(nowMs, table->byteBurst), memory_order_relaxed);
+}
+
+// Spins, yielding the CPU, while the entry is claimed. A claim lasts a few stores, by the lookup
+// which fills it or a reuse checking holders, but if its thread is preempted readers of the slot wait.
+static uint64_t LoadKey(ADMISSION_ENTRY *entry)
+{
+    uint64_t key;
+    while ((key = atomic_load(&entry->key)) == ADMISSION_CLAIMING)
+    {
+        sched_yield();
+    }
+    return key;
+}
+
+// returns 1 if entry still belongs to key once held. A reuse claims the key before it checks
+// holders, so either it sees this hold and gives the entry back, or this sees the new key.
+static int HoldEntry(ADMISSION_ENTRY *entry, uint64_t key)
+{
+    atomic_fetch_add(&entry->holders, 1);
+    if (LoadKey(entry) == key)
+        return 1;
+    atomic_fetch_sub(&entry->holders, 1);
+    return 0;
+}
+
+// Buckets are filled only by the lookup owning the claim, so losing lookups do not refill them.
+static ADMISSION_ENTRY *FillEntry(ADMISSION_TABLE *table, ADMISSION_ENTRY *entry, uint64_t key, uint64_t nowMs)
+{
+    ResetEntry(table, entry, nowMs);
+    atomic_fetch_add(&entry->holders, 1);
+    atomic_store(&entry->key, key);
+    return entry;
+}
+
+static int IsIdle(ADMISSION_ENTRY *entry, uint64_t nowMs)
+{
+    uint32_t lastSeen = BUCKET_TIME(atomic_load_explicit(&entry->connBucket, memory_order_relaxed));
+    uint32_t lastBytes = BUCKET_TIME(atomic_load_explicit(&entry->byteBucket, memory_order_relaxed));
+    if ((uint32_t)(lastBytes - lastSeen) < UINT32_MAX / 2)
+    {
+        lastSeen = lastBytes;
+    }
+    return (uint32_t)((uint32_t)nowMs - lastSeen) > ADMISSION_IDLE_MS && atomic_load(&entry->holders) == 0;
+}
+
+/*
+    returns NULL when address is not limited or table is full. Admission fails open in both cases.
+    Otherwise entry is held until AdmissionRelease, so it is not given to another address meanwhile.
+*/
+ADMISSION_ENTRY *AdmissionLookup(ADMISSION_TABLE *table, const struct sockaddr *addr, uint64_t nowMs)
+{
+    uint8_t address[16];
+
+    if (!table)
+        return NULL;
+
+    switch (addr->sa_family)
+    {
+    case AF_INET:
+        memset(address, 0, 10);
+        address[10] = address[11] = 0xff;
+        memcpy(address + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        break;
+    case AF_INET6:
+        memcpy(address, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        break;
+    default:
+        return NULL;
+    }
+
+    uint64_t key = HashAddress(address);
+    ADMISSION_ENTRY *reusable = NULL;
+
+    for (uint32_t probe = 0; probe < ADMISSION_MAX_PROBES; probe++)
+    {
+        ADMISSION_ENTRY *entry = &table->entries[(key + probe) & (ADMISSION_TABLE_SIZE - 1)];
+        uint64_t entryKey = LoadKey(entry);
+
+        if (entryKey == 0)
+        {
+            uint64_t expected = 0;
+            if (atomic_compare_exchange_strong(&entry->key, &expected, ADMISSION_CLAIMING))
+            {
+                return FillEntry(table, entry, key, nowMs);
+            }
+            // another lookup took it, maybe for the same address.
+            entryKey = LoadKey(entry);
+        }
+        if (entryKey == key)
+        {
+            if (HoldEntry(entry, key))
+                return entry;
+            continue;
+        }
+        if (!reusable && IsIdle(entry, nowMs))
+        {
+            reusable = entry;
+        }
+    }
+
+    // table is crowded around this key. Take over an idle entry of another address, unless it got a holder.
+    if (reusable)
+    {
+        uint64_t oldKey = LoadKey(reusable);
+        if (oldKey != 0 && oldKey != key &&
+            atomic_compare_exchange_strong(&reusable->key, &oldKey, ADMISSION_CLAIMING))
+        {
+            if (atomic_load(&reusable->holders) == 0)
+            {
+                return FillEntry(table, reusable, key, nowMs);
+            }
+            atomic_store(&reusable->key, oldKey);
+        }
+    }
+    return NULL;
+}
+
+// Connection closed, or rejected after its lookup.
+void AdmissionRelease(ADMISSION_ENTRY *entry)
+{
+    if (entry)
+    {
+        atomic_fetch_sub(&entry->holders, 1);
+    }
+}
+
+// returns 1 if connection is admitted.
+int AdmissionAcquireConnection(ADMISSION_TABLE *table, ADMISSION_ENTRY *entry, uint64_t nowMs)
+{
+    if (!table || !entry || table->connRate == 0)
+        return 1;
+
+    uint64_t maxTokens = (uint64_t)table->connBurst * 1000;
+    uint64_t bucket = atomic_load_explicit(&entry->connBucket, memory_order_relaxed);
+    uint64_t newBucket;
+
+    do
+    {
+        // rate is in connections per second, which is the same as milli-connections per ms.
+        uint64_t elapsed = (uint32_t)((uint32_t)nowMs - BUCKET_TIME(bucket));
+        uint64_t tokens = BUCKET_TOKENS(bucket) + elapsed * table->connRate;
+        if (tokens > maxTokens)
+        {
+            tokens = maxTokens;
+        }
+        if (tokens < 1000)
+        {
+            newBucket = BUCKET(nowMs, tokens);
+            atomic_compare_exchange_weak_explicit(&entry->connBucket, &bucket, newBucket, memory_order_relaxed, memory_order_relaxed);
+            return 0;
+        }
+        newBucket = BUCKET(nowMs, tokens - 1000);
+    } while (!atomic_compare_exchange_weak_explicit(&entry->connBucket, &bucket, newBucket, memory_order_relaxed, memory_order_relaxed));
+
+    return 1;
+}
+
+// consumes bytes from the bucket. Returns ms to wait before reading again from this address.
+uint32_t AdmissionConsumeBytes(ADMISSION_TABLE *table, ADMISSION_ENTRY *entry, uint32_t bytes, uint64_t nowMs)
+{
+    if (!table || !entry || table->byteRate == 0)
+        return 0;
+
+    uint64_t bucket = atomic_load_explicit(&entry->byteBucket, memory_order_relaxed);
+    uint64_t newBucket;
+    int64_t tokens;
+
+    do
+    {
+        uint32_t lastTime = BUCKET_TIME(bucket);
+        uint64_t elapsed = (uint32_t)((uint32_t)nowMs - lastTime);
+        uint64_t refill = elapsed * table->byteRate / 1000;
+
+        tokens = (int32_t)BUCKET_TOKENS(bucket);
+        // advance refill time only when some bytes were refilled, so slow rates are not lost.
+        if (refill > 0)
+        {
+            tokens += (int64_t)refill;
+            lastTime = (uint32_t)nowMs;
+        }
+        if (tokens > (int64_t)table->byteBurst)
+        {
+            tokens = table->byteBurst;
+        }
+        tokens -= bytes;
+        // debt is bounded so one huge read does not block an address for ever.
+        if (tokens < -(int64_t)table->byteBurst)
+        {
+            tokens = -(int64_t)table->byteBurst;
+        }
+        newBucket = BUCKET(lastTime, (uint32_t)(int32_t)tokens);
+    } while (!atomic_compare_exchange_weak_explicit(&entry->byteBucket, &bucket, newBucket, memory_order_relaxed, memory_order_relaxed));
+
+    if (tokens >= 0)
+        return 0;
+    return (uint32_t)((-tokens * 1000 + table->byteRate - 1) / table->byteRate);
+}
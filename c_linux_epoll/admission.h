@@ -0,0 +1,59 @@
+/*
+    admission.h
+
+    Per source address admission control: a connection rate and a byte rate token bucket
+    for each client IP, kept in a fixed size hash table shared by all workers. Buckets and
+    holders are updated with atomic operations, but the table is not lock-free: a lookup
+    reaching a slot which is being claimed for an address waits (yielding) until its key is set.
+
+    IPv4 clients are keyed as IPv4-mapped IPv6 addresses, so a client gets the same
+    buckets through the IPv4 and the dual-stack listeners. AF_UNIX clients are local
+    and not limited.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#define ADMISSION_TABLE_SIZE 65536 // must be a power of 2
+#define ADMISSION_MAX_PROBES 32
+#define ADMISSION_IDLE_MS 60000 // entries idle for longer and without holders can be reused by other addresses
+#define ADMISSION_CLAIMING UINT64_MAX // key of an entry being filled, by its first lookup or a reuse.
+
+/*
+    Buckets are packed in a 64 bits word, updated with compare and swap:
+    high 32 bits are the last refill time (ms, wraps every 49 days) and
+    low 32 bits are the tokens (milli-connections, or bytes as a signed value to keep the debt).
+*/
+typedef struct
+{
+    _Atomic uint64_t key; // hash of the address, 0 is a free entry.
+    _Atomic uint64_t connBucket;
+    _Atomic uint64_t byteBucket;
+    _Atomic uint32_t holders; // lookups not released yet: connections of the address spending its buckets.
+} ADMISSION_ENTRY;
+
+typedef struct
+{
+    uint32_t connRate;  // connections per second, 0 is unlimited.
+    uint32_t connBurst; // connections
+    uint32_t byteRate;  // bytes per second, 0 is unlimited.
+    uint32_t byteBurst; // bytes
+    uint64_t startMs;
+    ADMISSION_ENTRY *entries;
+} ADMISSION_TABLE;
+
+ADMISSION_TABLE *AdmissionCreate(uint32_t connRate, uint32_t connBurst, uint32_t byteRate, uint32_t byteBurst);
+void AdmissionFree(ADMISSION_TABLE *table);
+uint64_t AdmissionNowMs(ADMISSION_TABLE *table);
+ADMISSION_ENTRY *AdmissionLookup(ADMISSION_TABLE *table, const struct sockaddr *addr, uint64_t nowMs);
+void AdmissionRelease(ADMISSION_ENTRY *entry);
+int AdmissionAcquireConnection(ADMISSION_TABLE *table, ADMISSION_ENTRY *entry, uint64_t nowMs);
+uint32_t AdmissionConsumeBytes(ADMISSION_TABLE *table, ADMISSION_ENTRY *entry, uint32_t bytes, uint64_t nowMs);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+    capture.c
+
+    Traffic capture writer. See capture.h for the file format.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+#define CAPTURE_FILE_BUFFER (1024 * 1024)
+#define MAX_VARINT 10
+
+static uint64_t NowUs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static size_t PutVarint(uint8_t *buffer, uint64_t value)
+{
+    size_t length = 0;
+    while (value >= 0x80)
+    {
+        buffer[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (uint8_t)value;
+    return length;
+}
+
+static void PutLittleEndian(uint8_t *buffer, uint64_t value, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        buffer[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+CAPTURE *CaptureOpen(const char *path, int flags)
+{
+    uint8_t header[16];
+    CAPTURE *capture = (CAPTURE *)calloc(1, sizeof(CAPTURE));
+    if (!capture)
+        return NULL;
+
+    capture->file = fopen(path, "wb");
+    if (!capture->file)
+    {
+        free(capture);
+        return NULL;
+    }
+    setvbuf(capture->file, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+    capture->flags = flags;
+    capture->lastUs = NowUs(CLOCK_MONOTONIC);
+    pthread_mutex_init(&capture->lock, NULL);
+
+    memcpy(header, CAPTURE_MAGIC, 4);
+    PutLittleEndian(header + 4, CAPTURE_VERSION, 2);
+    PutLittleEndian(header + 6, (uint64_t)flags, 2);
+    PutLittleEndian(header + 8, NowUs(CLOCK_REALTIME), 8);
+    fwrite(header, 1, sizeof(header), capture->file);
+    return capture;
+}
+
+void CaptureClose(CAPTURE *capture)
+{
+    if (!capture)
+        return;
+    fclose(capture->file);
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+}
+
+// writes a record header. Must be called with the lock held: time is taken inside, so deltas never go backwards.
+static void WriteRecord(CAPTURE *capture, CAPTURE_RECORD_TYPE type, uint64_t connection, const void *data, size_t length)
+{
+    uint8_t record[1 + 3 * MAX_VARINT];
+    size_t recordLen = 0;
+    uint64_t now = NowUs(CLOCK_MONOTONIC);
+
+    record[recordLen++] = (uint8_t)type;
+    recordLen += PutVarint(record + recordLen, now - capture->lastUs);
+    recordLen += PutVarint(record + recordLen, connection);
+    if (type == CAPTURE_DATA)
+    {
+        recordLen += PutVarint(record + recordLen, length);
+    }
+    capture->lastUs = now;
+
+    fwrite(record, 1, recordLen, capture->file);
+    if (type == CAPTURE_DATA && (capture->flags & CAPTURE_PAYLOADS))
+    {
+        fwrite(data, 1, length, capture->file);
+    }
+}
+
+// returns the id of the new connection in the capture.
+uint64_t CaptureConnectionOpen(CAPTURE *capture)
+{
+    pthread_mutex_lock(&capture->lock);
+    uint64_t connection = capture->nextId++;
+    WriteRecord(capture, CAPTURE_OPEN, connection, NULL, 0);
+    pthread_mutex_unlock(&capture->lock);
+    return connection;
+}
+
+void CaptureData(CAPTURE *capture, uint64_t connection, const void *data, size_t length)
+{
+    pthread_mutex_lock(&capture->lock);
+    WriteRecord(capture, CAPTURE_DATA, connection, data, length);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+void CaptureConnectionClose(CAPTURE *capture, uint64_t connection)
+{
+    pthread_mutex_lock(&capture->lock);
+    WriteRecord(capture, CAPTURE_CLOSE, connection, NULL, 0);
+    pthread_mutex_unlock(&capture->lock);
+}
@@ -0,0 +1,62 @@
+/*
+    capture.h
+
+    Traffic capture: when each connection opens, sends a chunk and closes, so benchmarks can
+    replay production shaped traffic (see --scenario replay in test_echo_server.py).
+
+    File format, little endian:
+
+    Header (16 bytes):
+        char     magic[4]   "ECAP"
+        uint16_t version    1
+        uint16_t flags      CAPTURE_PAYLOADS if chunks include their bytes
+        uint64_t start      Unix time of the capture start, in microseconds
+
+    Records, until end of file:
+        uint8_t  type       CAPTURE_OPEN, CAPTURE_DATA or CAPTURE_CLOSE
+        varint   delta      microseconds since previous record
+        varint   connection connection id, in order of CAPTURE_OPEN from 0
+        varint   length     CAPTURE_DATA only: bytes received in one read
+        bytes    payload    CAPTURE_DATA only, if CAPTURE_PAYLOADS: the bytes received
+
+    Varints are LEB128: 7 bits per byte, low bits first, high bit set if more bytes follow.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define CAPTURE_MAGIC "ECAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_PAYLOADS 0x0001
+
+typedef enum
+{
+    CAPTURE_OPEN = 1,
+    CAPTURE_DATA,
+    CAPTURE_CLOSE
+} CAPTURE_RECORD_TYPE;
+
+typedef struct
+{
+    FILE *file;
+    int flags;
+    // records of all workers go through one lock, so each connection's records keep their order.
+    pthread_mutex_t lock;
+    uint64_t lastUs;
+    uint64_t nextId;
+} CAPTURE;
+
+CAPTURE *CaptureOpen(const char *path, int flags);
+void CaptureClose(CAPTURE *capture);
+uint64_t CaptureConnectionOpen(CAPTURE *capture);
+void CaptureData(CAPTURE *capture, uint64_t connection, const void *data, size_t length);
+void CaptureConnectionClose(CAPTURE *capture, uint64_t connection);
+
+#endif
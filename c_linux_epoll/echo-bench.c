@@ -0,0 +1,496 @@
+/*
+    echo-bench.c
+
+    Microbenchmarks of the echo state machine used by linux-epoll (echo-connection.c),
+    without network: receive -> send -> partial send retry -> re-arm.
+
+    Each benchmark runs over a range of payload sizes and connection counts:
+
+    fake          in-memory transport. Measures the state machine alone.
+    fake-partial  in-memory transport accepting half the payload on each send, so every
+                  message goes through the partial send retry path and two re-arms.
+    socketpair    AF_UNIX socketpairs and an epoll instance, like the server event loop.
+
+    Iterations are calibrated to run at least the minimum time (like Google Benchmark), and
+    results are reported as ns/op, allocations/op and cache misses/op. One op is one message
+    echoed. Cache misses need perf_event_open(2) to be allowed (see perf_event_paranoid).
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+
+    To compile:
+    gcc -Wall -O2 -o echo-bench echo-bench.c echo-connection.c perf-counters.c
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/perf_event.h>
+
+#include "echo-connection.h"
+#include "perf-counters.h"
+
+#define PROGRAM_VERSION "v1.0.0"
+#define DEFAULT_MIN_TIME_MS 500
+#define MAX_ITERATIONS 1000000000ULL
+
+typedef struct
+{
+    size_t inputPending; // bytes the fake peer has sent and the server has not read yet.
+    size_t sendLimit;    // max bytes accepted by each send, to force partial sends.
+} FAKE_SOCKET;
+
+typedef struct
+{
+    size_t payload;
+    int nConnections;
+    ECHO_STATE *echo;
+    FAKE_SOCKET *fakeSockets;
+    int *serverFds;
+    int *peerFds;
+    int epollFd;
+    ECHO_TRANSPORT transport;
+    char *payloadBuffer;
+    char *sinkBuffer;
+    uint64_t rearms;
+} BENCH_STATE;
+
+typedef struct
+{
+    const char *name;
+    int (*setup)(BENCH_STATE *state);
+    int (*run)(BENCH_STATE *state, uint64_t iterations); // -1 if the run failed
+    void (*teardown)(BENCH_STATE *state);
+} BENCHMARK;
+
+void Usage(const char *programName);
+uint64_t NowNs(void);
+ssize_t FakeRecv(void *context, int fd, void *buffer, size_t length);
+ssize_t FakeSend(void *context, int fd, const void *buffer, size_t length);
+int SetupFake(BENCH_STATE *state);
+int SetupFakePartial(BENCH_STATE *state);
+int RunFake(BENCH_STATE *state, uint64_t iterations);
+void TeardownFake(BENCH_STATE *state);
+int SetupSocketpair(BENCH_STATE *state);
+int RunSocketpair(BENCH_STATE *state, uint64_t iterations);
+void TeardownSocketpair(BENCH_STATE *state);
+void RunBenchmark(const BENCHMARK *benchmark, size_t payload, int nConnections, uint64_t minTimeNs);
+
+/*
+    Allocation counting. malloc family is interposed and calls glibc implementation,
+    counting only while a benchmark is measured.
+*/
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int gCountAllocations = 0;
+static uint64_t gAllocations = 0;
+
+void *malloc(size_t size)
+{
+    gAllocations += gCountAllocations;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    gAllocations += gCountAllocations;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    gAllocations += gCountAllocations;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+static const PERF_COUNTER_SPEC gPerfSpecs[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+};
+
+static const BENCHMARK gBenchmarks[] = {
+    {"fake", SetupFake, RunFake, TeardownFake},
+    {"fake-partial", SetupFakePartial, RunFake, TeardownFake},
+    {"socketpair", SetupSocketpair, RunSocketpair, TeardownSocketpair},
+};
+
+static const size_t gPayloads[] = {16, 64, 512, DATA_BUFSIZE};
+static const int gConnections[] = {1, 64, 1024};
+
+void Usage(const char *programName)
+{
+    printf("%s\nUsage: %s [-f filter] [-t min time ms]\n"
+           "  -f filter  run only benchmarks whose name contains filter\n"
+           "  -t ms      minimum time per benchmark (default: %d)\n",
+           PROGRAM_VERSION, programName, DEFAULT_MIN_TIME_MS);
+}
+
+uint64_t NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+ssize_t FakeRecv(void *context, int fd, void *buffer, size_t length)
+{
+    BENCH_STATE *state = (BENCH_STATE *)context;
+    FAKE_SOCKET *fakeSocket = &state->fakeSockets[fd];
+
+    if (fakeSocket->inputPending == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t received = length < fakeSocket->inputPending ? length : fakeSocket->inputPending;
+    memcpy(buffer, state->payloadBuffer, received);
+    fakeSocket->inputPending -= received;
+    return (ssize_t)received;
+}
+
+ssize_t FakeSend(void *context, int fd, const void *buffer, size_t length)
+{
+    BENCH_STATE *state = (BENCH_STATE *)context;
+    FAKE_SOCKET *fakeSocket = &state->fakeSockets[fd];
+
+    size_t sent = length < fakeSocket->sendLimit ? length : fakeSocket->sendLimit;
+    memcpy(state->sinkBuffer, buffer, sent);
+    return (ssize_t)sent;
+}
+
+int SetupFake(BENCH_STATE *state)
+{
+    state->fakeSockets = (FAKE_SOCKET *)calloc(state->nConnections, sizeof(FAKE_SOCKET));
+    for (int c = 0; c < state->nConnections; c++)
+    {
+        state->fakeSockets[c].sendLimit = state->payload;
+    }
+    state->transport.recv = FakeRecv;
+    state->transport.send = FakeSend;
+    state->transport.context = state;
+    return 0;
+}
+
+int SetupFakePartial(BENCH_STATE *state)
+{
+    SetupFake(state);
+    for (int c = 0; c < state->nConnections; c++)
+    {
+        state->fakeSockets[c].sendLimit = (state->payload + 1) / 2;
+    }
+    return 0;
+}
+
+int RunFake(BENCH_STATE *state, uint64_t iterations)
+{
+    int c = 0;
+    size_t sent;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        ECHO_STATE *echo = &state->echo[c];
+
+        // peer sends a message, connection is readable.
+        state->fakeSockets[c].inputPending = state->payload;
+        ECHO_RESULT result = EchoReceive(echo, c, &state->transport, &sent);
+
+        // event loop waits for writable and retries until all data is echoed.
+        while (result == ECHO_WAIT_SEND || (result == ECHO_CONTINUE && echo->waitingSend))
+        {
+            state->rearms += result == ECHO_WAIT_SEND;
+            result = EchoSendPending(echo, c, &state->transport, &sent);
+        }
+        state->rearms += result == ECHO_WAIT_RECEIVE;
+
+        if (++c == state->nConnections)
+        {
+            c = 0;
+        }
+    }
+    return 0;
+}
+
+void TeardownFake(BENCH_STATE *state)
+{
+    free(state->fakeSockets);
+}
+
+int SetupSocketpair(BENCH_STATE *state)
+{
+    state->serverFds = (int *)malloc(state->nConnections * sizeof(int));
+    state->peerFds = (int *)malloc(state->nConnections * sizeof(int));
+    state->transport = EchoSocketTransport;
+    state->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (state->epollFd < 0)
+    {
+        perror("epoll_create1");
+        // no socket created yet, so teardown closes nothing.
+        state->nConnections = 0;
+        return -1;
+    }
+
+    for (int c = 0; c < state->nConnections; c++)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0)
+        {
+            perror("socketpair");
+            state->nConnections = c;
+            return -1;
+        }
+        state->serverFds[c] = pair[0];
+        state->peerFds[c] = pair[1];
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u32 = (uint32_t)c;
+        if (epoll_ctl(state->epollFd, EPOLL_CTL_ADD, pair[0], &event) < 0)
+        {
+            // an unregistered socket would never wake up the benchmark.
+            perror("epoll_ctl");
+            state->nConnections = c + 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int RunSocketpair(BENCH_STATE *state, uint64_t iterations)
+{
+    struct epoll_event events[1];
+    int c = 0;
+    size_t sent;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        int fd = state->serverFds[c];
+        ECHO_STATE *echo = &state->echo[c];
+
+        if (write(state->peerFds[c], state->payloadBuffer, state->payload) != (ssize_t)state->payload)
+        {
+            perror("write");
+            return -1;
+        }
+
+        // readable, like the server loop.
+        epoll_wait(state->epollFd, events, 1, -1);
+        ECHO_RESULT result = EchoReceive(echo, fd, &state->transport, &sent);
+
+        while (result == ECHO_WAIT_SEND || (result == ECHO_CONTINUE && echo->waitingSend))
+        {
+            if (result == ECHO_WAIT_SEND)
+            {
+                struct epoll_event event = {EPOLLOUT | EPOLLRDHUP, {.u32 = (uint32_t)c}};
+                epoll_ctl(state->epollFd, EPOLL_CTL_MOD, fd, &event);
+                state->rearms++;
+            }
+            epoll_wait(state->epollFd, events, 1, -1);
+            result = EchoSendPending(echo, fd, &state->transport, &sent);
+        }
+        if (result == ECHO_WAIT_RECEIVE)
+        {
+            struct epoll_event event = {EPOLLIN | EPOLLRDHUP, {.u32 = (uint32_t)c}};
+            epoll_ctl(state->epollFd, EPOLL_CTL_MOD, fd, &event);
+            state->rearms++;
+        }
+
+        // peer reads the echo.
+        size_t received = 0;
+        while (received < state->payload)
+        {
+            ssize_t n = read(state->peerFds[c], state->sinkBuffer, DATA_BUFSIZE);
+            if (n > 0)
+            {
+                received += (size_t)n;
+            }
+            else if (n == 0)
+            {
+                fprintf(stderr, "read: connection closed before the echo\n");
+                return -1;
+            }
+            else if (errno != EAGAIN && errno != EINTR)
+            {
+                perror("read");
+                return -1;
+            }
+        }
+
+        if (++c == state->nConnections)
+        {
+            c = 0;
+        }
+    }
+    return 0;
+}
+
+void TeardownSocketpair(BENCH_STATE *state)
+{
+    for (int c = 0; c < state->nConnections; c++)
+    {
+        close(state->serverFds[c]);
+        close(state->peerFds[c]);
+    }
+    close(state->epollFd);
+    free(state->serverFds);
+    free(state->peerFds);
+}
+
+void RunBenchmark(const BENCHMARK *benchmark, size_t payload, int nConnections, uint64_t minTimeNs)
+{
+    BENCH_STATE state;
+    PERF_COUNTERS counters;
+    uint64_t perfValues[PERF_MAX_COUNTERS];
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    char name[128];
+
+    memset(&state, 0, sizeof(state));
+    state.payload = payload;
+    state.nConnections = nConnections;
+    state.payloadBuffer = (char *)malloc(DATA_BUFSIZE);
+    state.sinkBuffer = (char *)malloc(DATA_BUFSIZE);
+    memset(state.payloadBuffer, 'A', DATA_BUFSIZE);
+    state.echo = (ECHO_STATE *)calloc(nConnections, sizeof(ECHO_STATE));
+    for (int c = 0; c < nConnections; c++)
+    {
+        EchoStateInit(&state.echo[c]);
+    }
+
+    snprintf(name, sizeof(name), "%s/payload:%zu/conns:%d", benchmark->name, payload, nConnections);
+
+    if (benchmark->setup(&state) < 0)
+    {
+        printf("%-40s %s\n", name, "setup failed");
+        benchmark->teardown(&state);
+        goto cleanup;
+    }
+
+    // warm up and calibrate: grow iterations until a run is long enough to estimate the rate.
+    while (iterations < MAX_ITERATIONS)
+    {
+        uint64_t start = NowNs();
+        if (benchmark->run(&state, iterations) < 0)
+        {
+            printf("%-40s %s\n", name, "run failed");
+            benchmark->teardown(&state);
+            goto cleanup;
+        }
+        elapsed = NowNs() - start;
+        if (elapsed >= minTimeNs / 10)
+            break;
+        iterations *= 10;
+    }
+    iterations = elapsed ? iterations * minTimeNs / elapsed : iterations;
+    iterations = iterations ? iterations : 1;
+
+    PerfCountersOpen(&counters, gPerfSpecs, sizeof(gPerfSpecs) / sizeof(gPerfSpecs[0]));
+    state.rearms = 0;
+    gAllocations = 0;
+    gCountAllocations = 1;
+    PerfCountersEnable(&counters);
+
+    uint64_t start = NowNs();
+    int failed = benchmark->run(&state, iterations) < 0;
+    elapsed = NowNs() - start;
+
+    PerfCountersDisable(&counters);
+    gCountAllocations = 0;
+    PerfCountersRead(&counters, perfValues);
+    PerfCountersClose(&counters);
+
+    if (failed)
+    {
+        printf("%-40s %s\n", name, "run failed");
+        benchmark->teardown(&state);
+        goto cleanup;
+    }
+
+    char cacheMisses[32] = "n/a";
+    if (perfValues[0] != PERF_NOT_AVAILABLE)
+    {
+        snprintf(cacheMisses, sizeof(cacheMisses), "%.3f", (double)perfValues[0] / iterations);
+    }
+
+    printf("%-40s %12.1f %12.3f %16s %12.3f %14" PRIu64 "\n",
+           name,
+           (double)elapsed / iterations,
+           (double)gAllocations / iterations,
+           cacheMisses,
+           (double)state.rearms / iterations,
+           iterations);
+    fflush(stdout);
+
+    benchmark->teardown(&state);
+
+cleanup:
+    for (int c = 0; c < nConnections; c++)
+    {
+        EchoStateFree(&state.echo[c]);
+    }
+    free(state.echo);
+    free(state.payloadBuffer);
+    free(state.sinkBuffer);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = NULL;
+    uint64_t minTimeMs = DEFAULT_MIN_TIME_MS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:t:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            filter = optarg;
+            break;
+        case 't':
+            minTimeMs = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (minTimeMs == 0)
+    {
+        fprintf(stderr, "Minimum time must be greater than 0\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-40s %12s %12s %16s %12s %14s\n", "Benchmark", "ns/op", "allocs/op", "cache-misses/op", "rearms/op", "iterations");
+
+    for (size_t b = 0; b < sizeof(gBenchmarks) / sizeof(gBenchmarks[0]); b++)
+    {
+        for (size_t p = 0; p < sizeof(gPayloads) / sizeof(gPayloads[0]); p++)
+        {
+            for (size_t c = 0; c < sizeof(gConnections) / sizeof(gConnections[0]); c++)
+            {
+                char name[128];
+                snprintf(name, sizeof(name), "%s/payload:%zu/conns:%d", gBenchmarks[b].name, gPayloads[p], gConnections[c]);
+                if (filter && !strstr(name, filter))
+                    continue;
+                RunBenchmark(&gBenchmarks[b], gPayloads[p], gConnections[c], minTimeMs * 1000000ULL);
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+/*
+    echo-connection.c
+
+    Echo state machine of a client connection. See echo-connection.h.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "echo-connection.h"
+
+static ssize_t SocketRecv(void *context, int fd, void *buffer, size_t length)
+{
+    (void)context;
+    return recv(fd, buffer, length, 0);
+}
+
+static ssize_t SocketSend(void *context, int fd, const void *buffer, size_t length)
+{
+    (void)context;
+    return send(fd, buffer, length, MSG_NOSIGNAL);
+}
+
+const ECHO_TRANSPORT EchoSocketTransport = {SocketRecv, SocketSend, NULL};
+
+int EchoStateInit(ECHO_STATE *state)
+{
+    state->buffer = (char *)malloc(DATA_BUFSIZE);
+    state->bytesReceived = 0;
+    state->bytesSent = 0;
+    state->waitingSend = 0;
+    return state->buffer ? 0 : -1;
+}
+
+void EchoStateFree(ECHO_STATE *state)
+{
+    free(state->buffer);
+    state->buffer = NULL;
+}
+
+ECHO_RESULT EchoReceive(ECHO_STATE *state, int fd, const ECHO_TRANSPORT *transport, size_t *sent)
+{
+    *sent = 0;
+
+    ssize_t received = transport->recv(transport->context, fd, state->buffer, DATA_BUFSIZE);
+
+    if (received == 0)
+    {
+        return ECHO_PEER_CLOSED;
+    }
+    if (received < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? ECHO_NO_DATA : ECHO_RECV_ERROR;
+    }
+
+    state->bytesReceived = (size_t)received;
+    state->bytesSent = 0;
+    return EchoSendPending(state, fd, transport, sent);
+}
+
+ECHO_RESULT EchoSendPending(ECHO_STATE *state, int fd, const ECHO_TRANSPORT *transport, size_t *sent)
+{
+    ssize_t result = transport->send(transport->context, fd, state->buffer + state->bytesSent,
+                                     state->bytesReceived - state->bytesSent);
+
+    *sent = 0;
+    if (result < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            return ECHO_SEND_ERROR;
+        }
+        result = 0;
+    }
+
+    state->bytesSent += (size_t)result;
+    *sent = (size_t)result;
+
+    // Partial send: wait until connection is writable to send what remains, and stop reading meanwhile.
+    int pending = state->bytesSent < state->bytesReceived;
+    if (pending == state->waitingSend)
+    {
+        return ECHO_CONTINUE;
+    }
+    state->waitingSend = pending;
+    return pending ? ECHO_WAIT_SEND : ECHO_WAIT_RECEIVE;
+}
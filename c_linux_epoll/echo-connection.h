@@ -0,0 +1,54 @@
+/*
+    echo-connection.h
+
+    Echo state machine of a client connection: receive, send back, retry partial sends and
+    ask the event loop to re-arm the connection.
+
+    It does not know about epoll nor about sockets: I/O goes through an ECHO_TRANSPORT, so the
+    same code is driven by the server and by the microbenchmarks (see echo-bench.c).
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#ifndef ECHO_CONNECTION_H
+#define ECHO_CONNECTION_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DATA_BUFSIZE 2048
+
+typedef struct
+{
+    ssize_t (*recv)(void *context, int fd, void *buffer, size_t length);
+    ssize_t (*send)(void *context, int fd, const void *buffer, size_t length);
+    void *context;
+} ECHO_TRANSPORT;
+
+typedef enum
+{
+    ECHO_CONTINUE,     // keep waiting for the same event.
+    ECHO_NO_DATA,      // nothing to read yet.
+    ECHO_WAIT_SEND,    // partial send. Re-arm to wait until connection is writable.
+    ECHO_WAIT_RECEIVE, // pending data was sent. Re-arm to wait until connection is readable.
+    ECHO_PEER_CLOSED,
+    ECHO_RECV_ERROR, // errno holds the cause.
+    ECHO_SEND_ERROR  // errno holds the cause.
+} ECHO_RESULT;
+
+typedef struct
+{
+    char *buffer;
+    size_t bytesReceived;
+    size_t bytesSent;
+    int waitingSend; // partial send pending, connection is waiting to be writable.
+} ECHO_STATE;
+
+extern const ECHO_TRANSPORT EchoSocketTransport;
+
+int EchoStateInit(ECHO_STATE *state);
+void EchoStateFree(ECHO_STATE *state);
+ECHO_RESULT EchoReceive(ECHO_STATE *state, int fd, const ECHO_TRANSPORT *transport, size_t *sent);
+ECHO_RESULT EchoSendPending(ECHO_STATE *state, int fd, const ECHO_TRANSPORT *transport, size_t *sent);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+    echo-probes.h
+
+    USDT static tracepoints (DTrace / SystemTap / bpftrace compatible) of the Linux server.
+
+    Probes use semaphores: tracers increment them when they attach, so while nobody is
+    tracing, a probe site costs a test of a cold variable and a nop. Probe arguments
+    (timestamps included) are only evaluated when a tracer is attached.
+
+    Probes are compiled in when <sys/sdt.h> is available (systemtap-sdt-dev / systemtap-sdt-devel
+    packages). Define ECHO_NO_PROBES to leave them out.
+
+    Provider is echo_server. Probes and arguments:
+
+    accept(fd, worker, family, timestamp ns)
+    recv(fd, worker, bytes received, timestamp ns)
+    send(fd, worker, bytes sent, bytes pending, timestamp ns)
+    partial_send(fd, worker, bytes sent, bytes pending, timestamp ns)
+    send_retry(fd, worker, bytes sent, bytes pending, timestamp ns)
+    close(fd, worker, bytes echoed to the connection, timestamp ns)
+    migrate(fd, worker, target worker, bytes pending, timestamp ns)
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#ifndef ECHO_PROBES_H
+#define ECHO_PROBES_H
+
+#if !defined(ECHO_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define ECHO_HAS_PROBES 1
+#endif
+#endif
+
+#ifdef ECHO_HAS_PROBES
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define ECHO_PROBE_SEMAPHORE(name) echo_server_##name##_semaphore
+
+// semaphores are defined once, in the server translation unit, with ECHO_PROBE_DEFINE.
+#define ECHO_PROBE_DEFINE(name) \
+    unsigned short ECHO_PROBE_SEMAPHORE(name) __attribute__((unused, section(".probes")))
+
+#define ECHO_PROBE_ENABLED(name) __builtin_expect(ECHO_PROBE_SEMAPHORE(name) != 0, 0)
+
+#define ECHO_PROBE4(name, a1, a2, a3, a4)                      \
+    do                                                         \
+    {                                                          \
+        if (ECHO_PROBE_ENABLED(name))                          \
+            STAP_PROBE4(echo_server, name, a1, a2, a3, a4);     \
+    } while (0)
+
+#define ECHO_PROBE5(name, a1, a2, a3, a4, a5)                  \
+    do                                                         \
+    {                                                          \
+        if (ECHO_PROBE_ENABLED(name))                          \
+            STAP_PROBE5(echo_server, name, a1, a2, a3, a4, a5); \
+    } while (0)
+
+extern unsigned short ECHO_PROBE_SEMAPHORE(accept);
+extern unsigned short ECHO_PROBE_SEMAPHORE(recv);
+extern unsigned short ECHO_PROBE_SEMAPHORE(send);
+extern unsigned short ECHO_PROBE_SEMAPHORE(partial_send);
+extern unsigned short ECHO_PROBE_SEMAPHORE(send_retry);
+extern unsigned short ECHO_PROBE_SEMAPHORE(close);
+extern unsigned short ECHO_PROBE_SEMAPHORE(migrate);
+
+#else
+
+#define ECHO_PROBE_DEFINE(name) extern int echo_server_##name##_no_probe
+#define ECHO_PROBE_ENABLED(name) 0
+#define ECHO_PROBE4(name, a1, a2, a3, a4) \
+    do                                    \
+    {                                     \
+    } while (0)
+#define ECHO_PROBE5(name, a1, a2, a3, a4, a5) \
+    do                                        \
+    {                                         \
+    } while (0)
+
+#endif
+
+#endif
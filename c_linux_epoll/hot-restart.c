@@ -0,0 +1,182 @@
+/*
+    hot-restart.c
+
+    Descriptor passing for hot restart. See hot-restart.h.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hot-restart.h"
+
+static int FillAddress(const char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    return 0;
+}
+
+// Blocking listener. Replaces the socket of a previous server, which is gone or already restarted.
+int RestartListen(const char *path)
+{
+    struct sockaddr_un addr;
+    int listenSocket;
+
+    if (FillAddress(path, &addr) < 0)
+        return -1;
+
+    listenSocket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenSocket < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(listenSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenSocket, 1) < 0)
+    {
+        int error = errno;
+        close(listenSocket);
+        errno = error;
+        return -1;
+    }
+    return listenSocket;
+}
+
+// returns -1 if there is no server listening on path.
+int RestartConnect(const char *path)
+{
+    struct sockaddr_un addr;
+    int restartSocket;
+
+    if (FillAddress(path, &addr) < 0)
+        return -1;
+
+    restartSocket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (restartSocket < 0)
+        return -1;
+
+    if (connect(restartSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        int error = errno;
+        close(restartSocket);
+        errno = error;
+        return -1;
+    }
+    return restartSocket;
+}
+
+int RestartSend(int restartSocket, RESTART_HEADER *header, const void *payload, size_t payloadLen, const int *fds, int nFds)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * RESTART_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    if (nFds > RESTART_MAX_FDS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    header->magic = RESTART_MAGIC;
+    header->version = RESTART_VERSION;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(*header);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payloadLen;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = payloadLen ? 2 : 1;
+
+    if (nFds > 0)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nFds);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nFds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nFds);
+    }
+
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(restartSocket, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    return sent < 0 ? -1 : 0;
+}
+
+// returns payload length, or -1 on error or when peer closed the restart socket. Descriptors are close-on-exec.
+ssize_t RestartReceive(int restartSocket, RESTART_HEADER *header, void *payload, size_t payloadLen, int *fds, int *nFds)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * RESTART_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(*header);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = payloadLen;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received;
+    do
+    {
+        received = recvmsg(restartSocket, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    *nFds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); received >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            *nFds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nFds);
+        }
+    }
+
+    if (received < (ssize_t)sizeof(*header) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+        header->magic != RESTART_MAGIC || header->version != RESTART_VERSION)
+    {
+        for (int i = 0; i < *nFds; i++)
+        {
+            close(fds[i]);
+        }
+        *nFds = 0;
+        if (received >= 0)
+        {
+            errno = EPROTO;
+        }
+        return -1;
+    }
+    return received - (ssize_t)sizeof(*header);
+}
@@ -0,0 +1,55 @@
+/*
+    hot-restart.h
+
+    Messages exchanged by a running server and its replacement during a hot restart. They go
+    through an AF_UNIX SOCK_SEQPACKET socket, so each message is one header, an optional payload
+    and the descriptors passed with SCM_RIGHTS.
+
+    1 - New process connects to the restart socket of the running one.
+    2 - Old process sends RESTART_LISTENERS with its listening sockets.
+    3 - New process starts accepting on them and answers RESTART_READY. Until then old process
+        keeps serving, so a failed new process does not stop the server.
+    4 - Old process stops accepting and its workers, and sends a RESTART_CONNECTION for each
+        client connection, with the bytes received but not echoed yet as payload.
+    5 - Old process sends RESTART_DONE and exits.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RESTART_MAGIC 0x45434852 // "ECHR"
+#define RESTART_VERSION 1
+#define RESTART_MAX_FDS 8
+
+typedef enum
+{
+    RESTART_LISTENERS = 1,
+    RESTART_READY,
+    RESTART_CONNECTION,
+    RESTART_DONE
+} RESTART_MESSAGE_TYPE;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t type;
+    uint32_t pendingBytes; // RESTART_CONNECTION: payload length, bytes to echo before reading again.
+    uint64_t bytesEchoed;  // RESTART_CONNECTION: bytes echoed by old process.
+    struct sockaddr_storage address;                      // RESTART_CONNECTION: client address.
+    char unixSocketPath[sizeof(((struct sockaddr_un *)0)->sun_path)]; // RESTART_LISTENERS: path to unlink at exit.
+} RESTART_HEADER;
+
+int RestartListen(const char *path);
+int RestartConnect(const char *path);
+int RestartSend(int restartSocket, RESTART_HEADER *header, const void *payload, size_t payloadLen, const int *fds, int nFds);
+ssize_t RestartReceive(int restartSocket, RESTART_HEADER *header, void *payload, size_t payloadLen, int *fds, int *nFds);
+
+#endif
@@ -0,0 +1,2035 @@
+/*
+    linux-epoll.c
+
+    This is a simple echo server using Linux epoll with an event loop (reactor) per core.
+
+    Each worker thread owns an epoll instance and the connections it accepted. Workers that
+    stay busy hand their hottest connections to underloaded workers through lock-free
+    handoff queues.
+
+    With -s, workers share one epoll instance instead, like IOCP worker threads share a
+    completion port: connections and listeners are EPOLLONESHOT, so any free worker handles the
+    next event of any connection and re-arms it when done.
+
+    With -R, server can be restarted without dropping connections: a new process started with
+    the same restart socket receives listeners and connections from the running one.
+
+    With -P, each worker counts cycles, instructions, cache misses, branch misses, context
+    switches and syscalls of its own thread with perf_event_open(2), reported per message and
+    per KB echoed next to the other statistics.
+
+    With -C, server records when connections open, send and close to a capture file, which
+    test_echo_server.py replays (see capture.h).
+
+    New connections take a fast path: the TCP listener uses TCP_DEFER_ACCEPT and TCP Fast Open, so
+    the first request usually arrives with the handshake, and it is read and echoed right after
+    accept, before the connection is added to epoll. -F disables it to compare both.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+
+    To compile:
+    gcc -Wall -O2 -o linux-epoll linux-epoll.c echo-connection.c admission.c hot-restart.c perf-counters.c capture.c -lpthread
+
+    Built with gcc 12.2 (Debian 12) and run with test_echo_server.py on Linux 6.18.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+#include "echo-connection.h"
+#include "echo-probes.h"
+#include "admission.h"
+#include "hot-restart.h"
+#include "perf-counters.h"
+#include "capture.h"
+
+#define PROGRAM_VERSION "v1.1.0"
+
+#define MAX_CLIENTS 15000
+#define MAX_WORKERS 64
+#define MAX_LISTENERS 2
+#define MAX_EVENTS 256
+#define SHARED_MAX_EVENTS 1 // shared queue mode takes one event per wakeup, like GetQueuedCompletionStatus.
+#define ACCEPT_BATCH 16
+#define DEFER_ACCEPT_SECONDS 1 // connections with no data by then are accepted anyway.
+#define FASTOPEN_QUEUE 256     // pending Fast Open requests not accepted yet.
+#define UNIX_PATH_MAX sizeof(((struct sockaddr_un *)0)->sun_path)
+#define MAX_ADDR_STR (INET6_ADDRSTRLEN + 8 > UNIX_PATH_MAX + 5 ? INET6_ADDRSTRLEN + 8 : UNIX_PATH_MAX + 5)
+
+// Load balancing between workers. Utilisation values are in permille.
+#define BALANCE_INTERVAL_MS 100
+#define BUSY_THRESHOLD 750
+#define IDLE_THRESHOLD 400
+#define BUSY_WINDOWS 3
+#define MAX_MIGRATIONS_PER_WINDOW 4
+#define MIGRATION_COOLDOWN_MS 1000
+
+#define NS_PER_MS 1000000ULL
+
+ECHO_PROBE_DEFINE(accept);
+ECHO_PROBE_DEFINE(recv);
+ECHO_PROBE_DEFINE(send);
+ECHO_PROBE_DEFINE(partial_send);
+ECHO_PROBE_DEFINE(send_retry);
+ECHO_PROBE_DEFINE(close);
+ECHO_PROBE_DEFINE(migrate);
+
+#define STAT_ADD(worker, field, n) \
+    atomic_store_explicit(&(worker)->stats.field, atomic_load_explicit(&(worker)->stats.field, memory_order_relaxed) + (n), memory_order_relaxed)
+#define STAT_GET(worker, field) atomic_load_explicit(&(worker)->stats.field, memory_order_relaxed)
+
+// -P counters. Syscalls tracepoint id is looked up at startup.
+static PERF_COUNTER_SPEC gPerfSpecs[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches"},
+    {PERF_TYPE_TRACEPOINT, PERF_NOT_AVAILABLE, "syscalls"},
+};
+#define PERF_SYSCALLS_SPEC 5
+#define N_PERF_SPECS (int)(sizeof(gPerfSpecs) / sizeof(gPerfSpecs[0]))
+
+typedef enum
+{
+    SERVER_TYPE,
+    CLIENT_TYPE,
+    CONTROL_TYPE
+} CONNECTION_TYPE;
+
+typedef struct CONNECTION
+{
+    CONNECTION_TYPE type;
+    int fd;
+    ECHO_STATE echo;
+    struct sockaddr_storage clientAddr;
+    char addressStr[MAX_ADDR_STR]; // help with logging
+    uint64_t bytesEchoed;
+    // load accounting, used to choose connections to migrate.
+    uint64_t windowId;
+    uint64_t windowBytes;
+    uint64_t migratedAt;
+    int acceptedBy; // worker which accepted the connection, it keeps the connection count in shared queue mode.
+    // per address token buckets. NULL if address is not limited.
+    ADMISSION_ENTRY *admission;
+    uint64_t resumeAtMs; // reading paused by byte rate limit until then, 0 if not paused.
+    int paused; // linked in worker paused list. Only PauseReading links it, resumeAtMs alone does not.
+    uint64_t captureId;
+    // worker connections list.
+    struct CONNECTION *prev;
+    struct CONNECTION *next;
+    // worker paused connections list.
+    struct CONNECTION *pausedPrev;
+    struct CONNECTION *pausedNext;
+    // link in the handoff queue of the target worker.
+    struct CONNECTION *handoffNext;
+} CONNECTION;
+
+typedef struct
+{
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t echoedOnAccept; // first request read and echoed right after accept.
+    _Atomic uint64_t closed;
+    _Atomic uint64_t messages;
+    _Atomic uint64_t bytesEchoed;
+    _Atomic uint64_t partialSends;
+    _Atomic uint64_t migratedOut;
+    _Atomic uint64_t migratedIn;
+    _Atomic uint64_t restored; // received from previous process in a hot restart.
+    _Atomic uint64_t connections;
+    _Atomic uint64_t rejected;
+    _Atomic uint64_t paused;
+    // wakeup and lock contention.
+    _Atomic uint64_t wakeups;
+    _Atomic uint64_t emptyWakeups; // wakeups with nothing to do: another worker took the work.
+    _Atomic uint64_t lockAcquires;
+    _Atomic uint64_t lockContended;
+    _Atomic uint64_t lockWaitNs;
+} WORKER_STATS;
+
+struct SERVER;
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    int epollFd; // server epoll instance in shared queue mode.
+    CONNECTION control; // eventfd used to wake up worker for handoffs and shutdown. Unused in shared queue mode.
+    CONNECTION *connections;
+    CONNECTION *paused;
+    uint64_t nextResumeMs; // earliest resume time of paused connections, 0 if none.
+    // MPSC handoff queue. Any worker pushes, only the owner pops.
+    _Atomic(CONNECTION *) handoffHead;
+    // load published to peers, in permille.
+    _Atomic unsigned utilisation;
+    unsigned busyWindows;
+    uint64_t windowId;
+    uint64_t windowBytes;
+    WORKER_STATS stats;
+    ECHO_TRANSPORT transport; // socket I/O of the worker, which fires the recv probe before the echo is sent.
+    // hardware counters of the worker thread, readable by main thread once ready.
+    PERF_COUNTERS perf;
+    _Atomic int perfReady;
+    struct SERVER *server;
+} WORKER;
+
+typedef struct SERVER
+{
+    CONNECTION listeners[MAX_LISTENERS];
+    int nListeners;
+    char unixSocketPath[UNIX_PATH_MAX];
+    WORKER workers[MAX_WORKERS];
+    int nWorkers;
+    int balance;
+    // shared queue mode: one epoll instance for all workers and one connections list, protected by a lock.
+    int shared;
+    int epollFd;
+    CONNECTION control;
+    CONNECTION *connections;
+    pthread_mutex_t connectionsLock;
+    ADMISSION_TABLE *admission; // NULL if admission control is disabled.
+    int perf;                   // count hardware events per worker.
+    CAPTURE *capture;           // NULL if traffic is not recorded.
+    int fastSetup;              // read and echo new connections right after accept.
+    // hot restart.
+    char restartPath[UNIX_PATH_MAX];
+    int restartListener;
+    pthread_t restartThread;
+    _Atomic int restartSocket; // connected to the new process once it is ready, -1 otherwise.
+    _Atomic int nClients;
+    _Atomic int finish;
+} SERVER;
+
+void Usage(const char *programName);
+void PError(const char *mainMsg);
+char *FormatSockAddr(const struct sockaddr *addr, char *addrStrBuffer, size_t bufferLen);
+void ServerLog(CONNECTION *connection, const char *msg, ...);
+uint64_t NowNs(void);
+ssize_t ProbedRecv(void *context, int fd, void *buffer, size_t length);
+int CreateTcpListener(int port, int fastSetup);
+int CreateUnixListener(const char *path);
+SERVER *CreateServer(int *listenSockets, int nListeners, const char *unixSocketPath, int balance, int shared);
+void CloseServer(SERVER *server);
+int CreateEventQueue(SERVER *server, CONNECTION *control);
+int CreateWorkers(SERVER *server, int nWorkers);
+void *ServerWorkerThread(void *parameter);
+CONNECTION *RegisterClient(WORKER *worker, int clientSocket, struct sockaddr *clientAddr, ADMISSION_ENTRY *admission);
+void UnregisterClient(WORKER *worker, CONNECTION *connection);
+void LockConnections(WORKER *worker);
+void UnlockConnections(WORKER *worker);
+void RejectConnection(int clientSocket);
+int AcceptConnections(WORKER *worker, CONNECTION *listener);
+uint32_t EchoOnAccept(WORKER *worker, CONNECTION *connection);
+int ArmConnection(WORKER *worker, CONNECTION *connection, int op, uint32_t events);
+void RearmListener(WORKER *worker, CONNECTION *listener);
+void PauseReading(WORKER *worker, CONNECTION *connection);
+void ResumeConnections(WORKER *worker, uint64_t nowMs);
+int ProcessClientEvent(WORKER *worker, CONNECTION *connection, uint32_t events);
+int HandleEchoResult(WORKER *worker, CONNECTION *connection, ECHO_RESULT result, size_t sent, int rearm);
+ECHO_RESULT ReceiveClientData(WORKER *worker, CONNECTION *connection, size_t *sent);
+void PushHandoff(WORKER *target, CONNECTION *connection);
+CONNECTION *PopHandoffs(WORKER *worker);
+void ProcessHandoffs(WORKER *worker);
+void BalanceWorker(WORKER *worker, uint64_t busyNs, uint64_t windowNs, uint64_t now);
+void MigrateHotConnections(WORKER *worker, WORKER *target, uint64_t bytesToMove, uint64_t now);
+void PrintServerStats(SERVER *server);
+void PrintPerfStats(SERVER *server);
+void PrintPerfRow(const char *worker, const char *event, uint64_t value, uint64_t messages, uint64_t bytes);
+int StartRestartListener(SERVER *server, const char *path);
+void StopRestartListener(SERVER *server);
+void *RestartListenerThread(void *parameter);
+int SendListeners(SERVER *server, int restartSocket);
+int ReceiveListeners(int restartSocket, int *listenSockets, char *unixSocketPath);
+void StopAccepting(SERVER *server);
+int SendConnection(int restartSocket, CONNECTION *connection);
+void HandOffConnections(SERVER *server, int restartSocket);
+void RestoreConnection(SERVER *server, int target, const RESTART_HEADER *header, int clientSocket, const char *pending);
+int RestoreConnections(SERVER *server, int restartSocket);
+
+void Usage(const char *programName)
+{
+    printf("%s\nUsage: %s [-w workers] [-n] [-s] [-c rate[:burst]] [-b rate[:burst]] [-R path] [-P] [-C file [-d]] [-F] <port> [unix socket path]\n"
+           "  -w workers  number of worker reactors (default: one per core)\n"
+           "  -n          disable connection migration between workers\n"
+           "  -s          shared queue mode: all workers wait on one epoll instance (no migration)\n"
+           "  -c rate     max new connections per second from each client address\n"
+           "  -b rate     max bytes per second echoed to each client address\n"
+           "  -R path     hot restart socket. If a server listens on it, take over its listeners and connections\n"
+           "  -P          count hardware events per worker (cycles, instructions, cache misses, syscalls...)\n"
+           "  -C file     record connections and received chunk sizes to a capture file\n"
+           "  -d          record received bytes in the capture file too\n"
+           "  -F          disable connection setup fast path (TCP_DEFER_ACCEPT, TCP Fast Open, echo on accept)\n",
+           PROGRAM_VERSION, programName);
+}
+
+void PError(const char *mainMsg)
+{
+    int lastError = errno;
+    fprintf(stderr, "%s : %s (%d)\n", mainMsg, strerror(lastError), lastError);
+}
+
+char *FormatSockAddr(const struct sockaddr *addr, char *addrStrBuffer, size_t bufferLen)
+{
+    char ipStr[INET6_ADDRSTRLEN] = {0};
+
+    switch (addr->sa_family)
+    {
+    case AF_INET:
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, ipStr, INET6_ADDRSTRLEN);
+        snprintf(addrStrBuffer, bufferLen, "%s:%d", ipStr, ntohs(((const struct sockaddr_in *)addr)->sin_port));
+        break;
+    case AF_INET6:
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr, ipStr, INET6_ADDRSTRLEN);
+        snprintf(addrStrBuffer, bufferLen, "[%s]:%d", ipStr, ntohs(((const struct sockaddr_in6 *)addr)->sin6_port));
+        break;
+    case AF_UNIX:
+        // clients connected to an AF_UNIX socket are usually unnamed.
+        snprintf(addrStrBuffer, bufferLen, "unix:%.*s", (int)UNIX_PATH_MAX, ((const struct sockaddr_un *)addr)->sun_path);
+        break;
+    default:
+        snprintf(addrStrBuffer, bufferLen, "unknown family %d", addr->sa_family);
+    }
+    return addrStrBuffer;
+}
+
+void ServerLog(CONNECTION *connection, const char *msg, ...)
+{
+    va_list args;
+    va_start(args, msg);
+    printf("%s -> ", connection->addressStr);
+    vprintf(msg, args);
+    printf("\n");
+    va_end(args);
+}
+
+uint64_t NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int CreateTcpListener(int port, int fastSetup)
+{
+    struct sockaddr_storage localAddr;
+    socklen_t localAddrLen;
+    int listenSocket;
+
+    memset(&localAddr, 0, sizeof(localAddr));
+
+    // Prefer a dual-stack IPv6 socket, so IPv4 clients are accepted as IPv4-mapped addresses.
+    listenSocket = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (listenSocket >= 0)
+    {
+        int v6Only = 0;
+        setsockopt(listenSocket, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+
+        struct sockaddr_in6 *localAddr6 = (struct sockaddr_in6 *)&localAddr;
+        localAddr6->sin6_family = AF_INET6;
+        localAddr6->sin6_addr = in6addr_any;
+        localAddr6->sin6_port = htons((uint16_t)port);
+        localAddrLen = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        // IPv6 not available. Fallback to IPv4 only.
+        listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (listenSocket < 0)
+        {
+            PError("Error creating server socket");
+            return -1;
+        }
+        struct sockaddr_in *localAddr4 = (struct sockaddr_in *)&localAddr;
+        localAddr4->sin_family = AF_INET;
+        localAddr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        localAddr4->sin_port = htons((uint16_t)port);
+        localAddrLen = sizeof(struct sockaddr_in);
+    }
+
+    // Set SO_REUSEADDR option to allow reuse of the address
+    int optVal = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(optVal));
+
+    if (fastSetup)
+    {
+        // accept is not reported until data arrives, so first read on accept rarely finds nothing.
+        int deferSeconds = DEFER_ACCEPT_SECONDS;
+        if (setsockopt(listenSocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSeconds, sizeof(deferSeconds)) < 0)
+        {
+            PError("Warning: TCP_DEFER_ACCEPT not available");
+        }
+        // data in the SYN of returning clients. Also needs server bit (2) of net.ipv4.tcp_fastopen.
+        int fastOpenQueue = FASTOPEN_QUEUE;
+        if (setsockopt(listenSocket, IPPROTO_TCP, TCP_FASTOPEN, &fastOpenQueue, sizeof(fastOpenQueue)) < 0)
+        {
+            PError("Warning: TCP Fast Open not available");
+        }
+    }
+
+    if (bind(listenSocket, (struct sockaddr *)&localAddr, localAddrLen) < 0)
+    {
+        PError("Error binding server socket");
+        close(listenSocket);
+        return -1;
+    }
+
+    if (listen(listenSocket, SOMAXCONN) < 0)
+    {
+        PError("Error listening on server socket");
+        close(listenSocket);
+        return -1;
+    }
+    return listenSocket;
+}
+
+int CreateUnixListener(const char *path)
+{
+    struct sockaddr_un localAddr;
+    int listenSocket;
+
+    if (strlen(path) >= UNIX_PATH_MAX)
+    {
+        fprintf(stderr, "Unix socket path too long\n");
+        return -1;
+    }
+
+    listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenSocket < 0)
+    {
+        PError("Error creating unix socket");
+        return -1;
+    }
+
+    memset(&localAddr, 0, sizeof(localAddr));
+    localAddr.sun_family = AF_UNIX;
+    strncpy(localAddr.sun_path, path, UNIX_PATH_MAX - 1);
+
+    // remove socket file left by a previous run.
+    unlink(path);
+
+    if (bind(listenSocket, (struct sockaddr *)&localAddr, sizeof(localAddr)) < 0)
+    {
+        PError("Error binding unix socket");
+        close(listenSocket);
+        return -1;
+    }
+
+    if (listen(listenSocket, SOMAXCONN) < 0)
+    {
+        PError("Error listening on unix socket");
+        close(listenSocket);
+        return -1;
+    }
+    return listenSocket;
+}
+
+SERVER *CreateServer(int *listenSockets, int nListeners, const char *unixSocketPath, int balance, int shared)
+{
+    SERVER *server = (SERVER *)calloc(1, sizeof(SERVER));
+    for (int i = 0; i < nListeners; i++)
+    {
+        server->listeners[i].type = SERVER_TYPE;
+        server->listeners[i].fd = listenSockets[i];
+    }
+    server->nListeners = nListeners;
+    if (unixSocketPath)
+    {
+        strncpy(server->unixSocketPath, unixSocketPath, UNIX_PATH_MAX - 1);
+    }
+    // load is balanced by the shared queue itself.
+    server->balance = shared ? 0 : balance;
+    server->shared = shared;
+    server->epollFd = -1;
+    server->control.fd = -1;
+    server->restartListener = -1;
+    server->restartSocket = -1;
+    pthread_mutex_init(&server->connectionsLock, NULL);
+    return server;
+}
+
+void CloseServer(SERVER *server)
+{
+    if (!server)
+        return;
+
+    while (server->connections)
+    {
+        // a paused connection is in the paused list of the worker which paused it. Lists are not used anymore.
+        server->connections->resumeAtMs = 0;
+        server->connections->paused = 0;
+        UnregisterClient(&server->workers[0], server->connections);
+    }
+    if (server->shared)
+    {
+        close(server->control.fd);
+        close(server->epollFd);
+    }
+
+    for (int w = 0; w < server->nWorkers; w++)
+    {
+        WORKER *worker = &server->workers[w];
+
+        while (worker->connections)
+        {
+            UnregisterClient(worker, worker->connections);
+        }
+        // connections handed off to a worker that finished before adopting them.
+        CONNECTION *pending = PopHandoffs(worker);
+        while (pending)
+        {
+            CONNECTION *next = pending->handoffNext;
+            close(pending->fd);
+            EchoStateFree(&pending->echo);
+            free(pending);
+            pending = next;
+        }
+        if (!server->shared)
+        {
+            close(worker->control.fd);
+            close(worker->epollFd);
+        }
+    }
+    for (int i = 0; i < server->nListeners; i++)
+    {
+        close(server->listeners[i].fd);
+    }
+    if (server->unixSocketPath[0])
+    {
+        unlink(server->unixSocketPath);
+    }
+    for (int w = 0; w < server->nWorkers; w++)
+    {
+        if (atomic_load(&server->workers[w].perfReady))
+        {
+            PerfCountersClose(&server->workers[w].perf);
+        }
+    }
+    AdmissionFree(server->admission);
+    CaptureClose(server->capture);
+    pthread_mutex_destroy(&server->connectionsLock);
+    free(server);
+}
+
+// Creates an epoll instance with a control eventfd and all listeners. Returns the epoll descriptor or -1.
+int CreateEventQueue(SERVER *server, CONNECTION *control)
+{
+    struct epoll_event event;
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epollFd < 0)
+    {
+        PError("Error creating epoll instance");
+        return -1;
+    }
+
+    control->type = CONTROL_TYPE;
+    control->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.ptr = control;
+    if (control->fd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, control->fd, &event) < 0)
+    {
+        PError("Error creating worker control eventfd");
+        if (control->fd >= 0)
+        {
+            close(control->fd);
+            control->fd = -1;
+        }
+        close(epollFd);
+        return -1;
+    }
+
+    // every worker waits on all listeners. EPOLLEXCLUSIVE avoids waking all of them on each connection.
+    // It only works across epoll instances: in shared queue mode there is one instance, so a listener is
+    // EPOLLONESHOT instead, and the worker which gets its event re-arms it after accepting.
+    for (int i = 0; i < server->nListeners; i++)
+    {
+        event.events = EPOLLIN | (server->shared ? EPOLLONESHOT : EPOLLEXCLUSIVE);
+        event.data.ptr = &server->listeners[i];
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, server->listeners[i].fd, &event) < 0)
+        {
+            PError("Error adding listener to epoll");
+        }
+    }
+    return epollFd;
+}
+
+// recv probe is fired here, between the read and the echo, so recv to send latency is measured from it.
+ssize_t ProbedRecv(void *context, int fd, void *buffer, size_t length)
+{
+    ssize_t received = EchoSocketTransport.recv(EchoSocketTransport.context, fd, buffer, length);
+
+#ifdef ECHO_HAS_PROBES
+    if (received > 0)
+    {
+        ECHO_PROBE4(recv, fd, ((WORKER *)context)->id, received, NowNs());
+    }
+#else
+    (void)context;
+#endif
+    return received;
+}
+
+int CreateWorkers(SERVER *server, int nWorkers)
+{
+    int workersCreated = 0;
+    long nCores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (server->shared)
+    {
+        server->epollFd = CreateEventQueue(server, &server->control);
+        if (server->epollFd < 0)
+            return 0;
+    }
+
+    for (int w = 0; w < nWorkers; w++)
+    {
+        WORKER *worker = &server->workers[workersCreated];
+
+        worker->id = workersCreated;
+        worker->server = server;
+        worker->transport.recv = ProbedRecv;
+        worker->transport.send = EchoSocketTransport.send; // ignores the context
+        worker->transport.context = worker;
+        if (server->shared)
+        {
+            worker->epollFd = server->epollFd;
+            worker->control.fd = -1;
+        }
+        else
+        {
+            worker->epollFd = CreateEventQueue(server, &worker->control);
+            if (worker->epollFd < 0)
+                continue;
+        }
+
+        if (pthread_create(&worker->thread, NULL, ServerWorkerThread, worker) != 0)
+        {
+            fprintf(stderr, "Error creating a thread\n");
+            if (!server->shared)
+            {
+                close(worker->control.fd);
+                close(worker->epollFd);
+            }
+            continue;
+        }
+
+        // one reactor per core.
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(workersCreated % nCores, &cpuSet);
+        pthread_setaffinity_np(worker->thread, sizeof(cpu_set_t), &cpuSet);
+
+        workersCreated++;
+    }
+    server->nWorkers = workersCreated;
+    return workersCreated;
+}
+
+CONNECTION *RegisterClient(WORKER *worker, int clientSocket, struct sockaddr *clientAddr, ADMISSION_ENTRY *admission)
+{
+    CONNECTION *connection = (CONNECTION *)calloc(1, sizeof(CONNECTION));
+
+    connection->type = CLIENT_TYPE;
+    connection->fd = clientSocket;
+    EchoStateInit(&connection->echo);
+    memcpy(&connection->clientAddr, clientAddr, sizeof(struct sockaddr_storage));
+    FormatSockAddr((struct sockaddr *)&connection->clientAddr, connection->addressStr, MAX_ADDR_STR);
+    connection->admission = admission;
+    connection->acceptedBy = worker->id;
+    if (worker->server->capture)
+    {
+        connection->captureId = CaptureConnectionOpen(worker->server->capture);
+    }
+
+    // in shared queue mode any worker may close the connection, so the list is shared too.
+    CONNECTION **connections = worker->server->shared ? &worker->server->connections : &worker->connections;
+    if (worker->server->shared)
+    {
+        LockConnections(worker);
+    }
+    connection->next = *connections;
+    if (*connections)
+    {
+        (*connections)->prev = connection;
+    }
+    *connections = connection;
+    if (worker->server->shared)
+    {
+        UnlockConnections(worker);
+    }
+    atomic_fetch_add_explicit(&worker->stats.connections, 1, memory_order_relaxed);
+
+    return connection;
+}
+
+void UnregisterClient(WORKER *worker, CONNECTION *connection)
+{
+    if (!connection)
+        return;
+
+    ECHO_PROBE4(close, connection->fd, worker->id, connection->bytesEchoed, NowNs());
+
+    // closing the descriptor removes it from the epoll set too.
+    close(connection->fd);
+
+    SERVER *server = worker->server;
+    if (server->capture)
+    {
+        CaptureConnectionClose(server->capture, connection->captureId);
+    }
+    CONNECTION **connections = server->shared ? &server->connections : &worker->connections;
+    WORKER *owner = server->shared ? &server->workers[connection->acceptedBy] : worker;
+    if (server->shared)
+    {
+        LockConnections(worker);
+    }
+    if (connection->prev)
+    {
+        connection->prev->next = connection->next;
+    }
+    else
+    {
+        *connections = connection->next;
+    }
+    if (connection->next)
+    {
+        connection->next->prev = connection->prev;
+    }
+    if (server->shared)
+    {
+        UnlockConnections(worker);
+    }
+
+    if (connection->paused)
+    {
+        if (connection->pausedPrev)
+        {
+            connection->pausedPrev->pausedNext = connection->pausedNext;
+        }
+        else
+        {
+            worker->paused = connection->pausedNext;
+        }
+        if (connection->pausedNext)
+        {
+            connection->pausedNext->pausedPrev = connection->pausedPrev;
+        }
+    }
+
+    // entry can be reused by another address once no connection holds it.
+    AdmissionRelease(connection->admission);
+    EchoStateFree(&connection->echo);
+    free(connection);
+
+    atomic_fetch_sub(&server->nClients, 1);
+    atomic_fetch_sub_explicit(&owner->stats.connections, 1, memory_order_relaxed);
+    STAT_ADD(worker, closed, 1);
+}
+
+// Connections list lock of shared queue mode. Contention is measured: trylock first, then wait.
+void LockConnections(WORKER *worker)
+{
+    STAT_ADD(worker, lockAcquires, 1);
+    if (pthread_mutex_trylock(&worker->server->connectionsLock) != 0)
+    {
+        uint64_t start = NowNs();
+        pthread_mutex_lock(&worker->server->connectionsLock);
+        STAT_ADD(worker, lockContended, 1);
+        STAT_ADD(worker, lockWaitNs, NowNs() - start);
+    }
+}
+
+void UnlockConnections(WORKER *worker)
+{
+    pthread_mutex_unlock(&worker->server->connectionsLock);
+}
+
+// Reset instead of a graceful close, so kernel frees the socket right away (no TIME_WAIT).
+void RejectConnection(int clientSocket)
+{
+    struct linger lingerOpt = {1, 0};
+    setsockopt(clientSocket, SOL_SOCKET, SO_LINGER, &lingerOpt, sizeof(lingerOpt));
+    close(clientSocket);
+}
+
+// returns the number of connections accepted.
+int AcceptConnections(WORKER *worker, CONNECTION *listener)
+{
+    SERVER *server = worker->server;
+    int accepted = 0;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++)
+    {
+        struct sockaddr_storage remoteAddr;
+        socklen_t remoteLen = sizeof(remoteAddr);
+
+        memset(&remoteAddr, 0, sizeof(remoteAddr));
+        int acceptSocket = accept4(listener->fd, (struct sockaddr *)&remoteAddr, &remoteLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (acceptSocket < 0)
+        {
+            // listener is shared by all workers, another one may have taken the connection.
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                PError("Error accepting a connection attempt");
+            }
+            return accepted;
+        }
+        accepted++;
+
+        // admission is checked before any connection data is allocated.
+        ADMISSION_ENTRY *admission = NULL;
+        if (server->admission)
+        {
+            uint64_t nowMs = AdmissionNowMs(server->admission);
+            admission = AdmissionLookup(server->admission, (struct sockaddr *)&remoteAddr, nowMs);
+            if (!AdmissionAcquireConnection(server->admission, admission, nowMs))
+            {
+                AdmissionRelease(admission);
+                STAT_ADD(worker, rejected, 1);
+                RejectConnection(acceptSocket);
+                continue;
+            }
+        }
+
+        if (atomic_fetch_add(&server->nClients, 1) >= MAX_CLIENTS)
+        {
+            atomic_fetch_sub(&server->nClients, 1);
+            fprintf(stderr, "Max clients exceeded\n");
+            AdmissionRelease(admission);
+            STAT_ADD(worker, rejected, 1);
+            RejectConnection(acceptSocket);
+            continue;
+        }
+
+        CONNECTION *connection = RegisterClient(worker, acceptSocket, (struct sockaddr *)&remoteAddr, admission);
+        STAT_ADD(worker, accepted, 1);
+        ECHO_PROBE4(accept, acceptSocket, worker->id, remoteAddr.ss_family, NowNs());
+        ServerLog(connection, "Connected");
+
+        uint32_t events = EchoOnAccept(worker, connection);
+        if (!events)
+        {
+            UnregisterClient(worker, connection);
+            continue;
+        }
+
+        // in shared queue mode another worker may handle the connection as soon as it is added.
+        if (ArmConnection(worker, connection, EPOLL_CTL_ADD, events) < 0)
+        {
+            PError("Error when adding socket to epoll");
+            UnregisterClient(worker, connection);
+            continue;
+        }
+    }
+    return accepted;
+}
+
+/*
+    Reads and echoes what arrived with the handshake before the connection is in the epoll set, which
+    saves a wakeup before the first echo. Returns the events to wait for, or 0 if connection must be closed.
+    Connections of a byte rate limited server take the normal path, so pauses are always applied by the
+    event loop.
+*/
+uint32_t EchoOnAccept(WORKER *worker, CONNECTION *connection)
+{
+    SERVER *server = worker->server;
+    size_t sent;
+
+    if (!server->fastSetup || (server->admission && server->admission->byteRate))
+        return EPOLLIN;
+
+    ECHO_RESULT echoResult = ReceiveClientData(worker, connection, &sent);
+    if (echoResult == ECHO_NO_DATA)
+        return EPOLLIN;
+    // not in the epoll set yet. It is added with the events returned instead of re-armed.
+    if (HandleEchoResult(worker, connection, echoResult, sent, 0) < 0)
+        return 0;
+
+    STAT_ADD(worker, echoedOnAccept, 1);
+    return connection->echo.waitingSend ? EPOLLOUT : EPOLLIN;
+}
+
+/*
+    Adds or re-arms a connection in the worker epoll instance. In shared queue mode connections are
+    EPOLLONESHOT: an event disables the connection until the worker handling it re-arms it, so only
+    one worker handles a connection at a time. Worker must not touch the connection after re-arming.
+*/
+int ArmConnection(WORKER *worker, CONNECTION *connection, int op, uint32_t events)
+{
+    struct epoll_event event;
+    event.events = events | EPOLLRDHUP | (worker->server->shared ? EPOLLONESHOT : 0);
+    event.data.ptr = connection;
+    return epoll_ctl(worker->epollFd, op, connection->fd, &event);
+}
+
+// Shared queue mode only. Pending connections raise the event again at once, for the next free worker.
+void RearmListener(WORKER *worker, CONNECTION *listener)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = listener;
+    // ENOENT: listener was removed by StopAccepting, a new process accepts now.
+    if (epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, listener->fd, &event) < 0 && errno != ENOENT)
+    {
+        PError("Error re-arming listener");
+    }
+}
+
+// rearm is 0 when connection is not in the epoll set, or it is re-armed after the event is fully handled.
+int HandleEchoResult(WORKER *worker, CONNECTION *connection, ECHO_RESULT result, size_t sent, int rearm)
+{
+    STAT_ADD(worker, bytesEchoed, sent);
+    connection->bytesEchoed += sent;
+
+    // bytes are accounted by window, so hot connections can be found when balancing.
+    if (connection->windowId != worker->windowId)
+    {
+        connection->windowId = worker->windowId;
+        connection->windowBytes = 0;
+    }
+    connection->windowBytes += (uint64_t)sent;
+    worker->windowBytes += (uint64_t)sent;
+
+    switch (result)
+    {
+    case ECHO_CONTINUE:
+    case ECHO_NO_DATA:
+        return 0;
+    case ECHO_WAIT_SEND:
+    case ECHO_WAIT_RECEIVE:
+        if (rearm && ArmConnection(worker, connection, EPOLL_CTL_MOD, result == ECHO_WAIT_SEND ? EPOLLOUT : EPOLLIN) < 0)
+        {
+            ServerLog(connection, "Error rearming connection: %s. Closing connection", strerror(errno));
+            return -1;
+        }
+        if (result == ECHO_WAIT_SEND)
+        {
+            STAT_ADD(worker, partialSends, 1);
+            ECHO_PROBE5(partial_send, connection->fd, worker->id, sent,
+                        connection->echo.bytesReceived - connection->echo.bytesSent, NowNs());
+        }
+        return 0;
+    case ECHO_PEER_CLOSED:
+        ServerLog(connection, "Client close connection");
+        return -1;
+    case ECHO_RECV_ERROR:
+        ServerLog(connection, "Error fetching data: %s. Closing connection", strerror(errno));
+        return -1;
+    case ECHO_SEND_ERROR:
+        ServerLog(connection, "Error sending data: %s. Closing connection", strerror(errno));
+        return -1;
+    }
+    return -1;
+}
+
+// Stops reading from a connection which exceeded the byte rate of its address until resumeAtMs.
+void PauseReading(WORKER *worker, CONNECTION *connection)
+{
+    struct epoll_event event;
+
+    // no events: only errors and hang ups wake up the worker while paused. In shared queue mode
+    // the connection is already disabled by EPOLLONESHOT, and not re-arming it keeps other workers away.
+    event.events = 0;
+    event.data.ptr = connection;
+    if (!worker->server->shared && epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, connection->fd, &event) < 0)
+    {
+        connection->resumeAtMs = 0;
+        return;
+    }
+
+    connection->pausedPrev = NULL;
+    connection->pausedNext = worker->paused;
+    if (worker->paused)
+    {
+        worker->paused->pausedPrev = connection;
+    }
+    worker->paused = connection;
+    connection->paused = 1;
+    if (!worker->nextResumeMs || connection->resumeAtMs < worker->nextResumeMs)
+    {
+        worker->nextResumeMs = connection->resumeAtMs;
+    }
+    STAT_ADD(worker, paused, 1);
+}
+
+void ResumeConnections(WORKER *worker, uint64_t nowMs)
+{
+    CONNECTION *connection = worker->paused;
+
+    worker->nextResumeMs = 0;
+    while (connection)
+    {
+        CONNECTION *next = connection->pausedNext;
+
+        if (connection->resumeAtMs <= nowMs)
+        {
+            if (connection->pausedPrev)
+            {
+                connection->pausedPrev->pausedNext = next;
+            }
+            else
+            {
+                worker->paused = next;
+            }
+            if (next)
+            {
+                next->pausedPrev = connection->pausedPrev;
+            }
+            connection->resumeAtMs = 0;
+            connection->paused = 0;
+
+            if (ArmConnection(worker, connection, EPOLL_CTL_MOD, EPOLLIN) < 0)
+            {
+                ServerLog(connection, "Error resuming connection: %s. Closing connection", strerror(errno));
+                UnregisterClient(worker, connection);
+            }
+        }
+        else if (!worker->nextResumeMs || connection->resumeAtMs < worker->nextResumeMs)
+        {
+            worker->nextResumeMs = connection->resumeAtMs;
+        }
+        connection = next;
+    }
+}
+
+// Receives and echoes a chunk, and accounts it in stats, capture and byte rate of the address.
+ECHO_RESULT ReceiveClientData(WORKER *worker, CONNECTION *connection, size_t *sent)
+{
+    ECHO_RESULT echoResult = EchoReceive(&connection->echo, connection->fd, &worker->transport, sent);
+
+    if (echoResult != ECHO_NO_DATA && echoResult != ECHO_PEER_CLOSED && echoResult != ECHO_RECV_ERROR)
+    {
+        STAT_ADD(worker, messages, 1);
+        if (worker->server->capture)
+        {
+            CaptureData(worker->server->capture, connection->captureId, connection->echo.buffer, connection->echo.bytesReceived);
+        }
+        if (connection->admission)
+        {
+            ADMISSION_TABLE *admission = worker->server->admission;
+            uint64_t nowMs = AdmissionNowMs(admission);
+            uint32_t delay = AdmissionConsumeBytes(admission, connection->admission, (uint32_t)connection->echo.bytesReceived, nowMs);
+            if (delay)
+            {
+                connection->resumeAtMs = nowMs + delay;
+            }
+        }
+        ECHO_PROBE5(send, connection->fd, worker->id, *sent,
+                    connection->echo.bytesReceived - connection->echo.bytesSent, NowNs());
+    }
+    return echoResult;
+}
+
+// returns 0 if there was nothing to do.
+int ProcessClientEvent(WORKER *worker, CONNECTION *connection, uint32_t events)
+{
+    int result = 0;
+    int work = 1;
+    size_t sent;
+
+    if (events & EPOLLOUT)
+    {
+        ECHO_RESULT echoResult = EchoSendPending(&connection->echo, connection->fd, &worker->transport, &sent);
+        ECHO_PROBE5(send_retry, connection->fd, worker->id, sent,
+                    connection->echo.bytesReceived - connection->echo.bytesSent, NowNs());
+        // shared queue mode re-arms after the event is fully handled.
+        result = HandleEchoResult(worker, connection, echoResult, sent, !worker->server->shared);
+    }
+    else if (events & EPOLLIN)
+    {
+        // data still queued in socket is read before handling a peer shutdown.
+        ECHO_RESULT echoResult = ReceiveClientData(worker, connection, &sent);
+        work = echoResult != ECHO_NO_DATA;
+        result = HandleEchoResult(worker, connection, echoResult, sent, !worker->server->shared);
+    }
+    else if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+    {
+        ServerLog(connection, "Closing connection");
+        result = -1;
+    }
+
+    if (result < 0)
+    {
+        UnregisterClient(worker, connection);
+    }
+    else if (connection->resumeAtMs && !connection->echo.waitingSend)
+    {
+        // byte rate exceeded. Pause once all received data is echoed.
+        PauseReading(worker, connection);
+    }
+    else if (worker->server->shared &&
+             ArmConnection(worker, connection, EPOLL_CTL_MOD, connection->echo.waitingSend ? EPOLLOUT : EPOLLIN) < 0)
+    {
+        ServerLog(connection, "Error rearming connection: %s. Closing connection", strerror(errno));
+        UnregisterClient(worker, connection);
+    }
+    return work;
+}
+
+void PushHandoff(WORKER *target, CONNECTION *connection)
+{
+    CONNECTION *head = atomic_load_explicit(&target->handoffHead, memory_order_relaxed);
+    do
+    {
+        connection->handoffNext = head;
+    } while (!atomic_compare_exchange_weak_explicit(&target->handoffHead, &head, connection,
+                                                    memory_order_release, memory_order_relaxed));
+
+    uint64_t wake = 1;
+    if (write(target->control.fd, &wake, sizeof(wake)) < 0 && errno != EAGAIN)
+    {
+        PError("Error waking up worker");
+    }
+}
+
+CONNECTION *PopHandoffs(WORKER *worker)
+{
+    // Consumer takes the whole stack at once, so there is no ABA problem. Reverse it to keep arrival order.
+    CONNECTION *stack = atomic_exchange_explicit(&worker->handoffHead, NULL, memory_order_acquire);
+    CONNECTION *list = NULL;
+    while (stack)
+    {
+        CONNECTION *next = stack->handoffNext;
+        stack->handoffNext = list;
+        list = stack;
+        stack = next;
+    }
+    return list;
+}
+
+void ProcessHandoffs(WORKER *worker)
+{
+    uint64_t counter;
+    if (read(worker->control.fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+    {
+        PError("Error reading worker control eventfd");
+    }
+
+    CONNECTION *connection = PopHandoffs(worker);
+    while (connection)
+    {
+        CONNECTION *next = connection->handoffNext;
+
+        connection->handoffNext = NULL;
+        connection->prev = NULL;
+        connection->next = worker->connections;
+        if (worker->connections)
+        {
+            worker->connections->prev = connection;
+        }
+        worker->connections = connection;
+        connection->windowId = 0;
+        connection->windowBytes = 0;
+        atomic_fetch_add_explicit(&worker->stats.connections, 1, memory_order_relaxed);
+        if (connection->migratedAt)
+        {
+            STAT_ADD(worker, migratedIn, 1);
+        }
+        else
+        {
+            STAT_ADD(worker, restored, 1);
+        }
+
+        // Unsent bytes travel with the connection, so keep waiting for EPOLLOUT if a send was pending.
+        if (ArmConnection(worker, connection, EPOLL_CTL_ADD, connection->echo.waitingSend ? EPOLLOUT : EPOLLIN) < 0)
+        {
+            ServerLog(connection, "Error adopting migrated connection: %s. Closing connection", strerror(errno));
+            UnregisterClient(worker, connection);
+        }
+        connection = next;
+    }
+}
+
+void MigrateHotConnections(WORKER *worker, WORKER *target, uint64_t bytesToMove, uint64_t now)
+{
+    uint64_t moved = 0;
+
+    for (int m = 0; m < MAX_MIGRATIONS_PER_WINDOW && moved < bytesToMove; m++)
+    {
+        CONNECTION *hottest = NULL;
+        int activeConnections = 0;
+
+        for (CONNECTION *c = worker->connections; c; c = c->next)
+        {
+            if (c->windowId != worker->windowId || c->windowBytes == 0)
+                continue;
+            activeConnections++;
+            // moving a connection hotter than twice what is needed only moves the hot spot.
+            if (c->windowBytes > 2 * (bytesToMove - moved))
+                continue;
+            if (c->migratedAt && now - c->migratedAt < MIGRATION_COOLDOWN_MS * NS_PER_MS)
+                continue;
+            // paused connections stay in the worker which will resume them.
+            if (c->resumeAtMs)
+                continue;
+            if (!hottest || c->windowBytes > hottest->windowBytes)
+                hottest = c;
+        }
+
+        // always keep some work in this worker.
+        if (!hottest || activeConnections < 2)
+            break;
+
+        if (epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, hottest->fd, NULL) < 0)
+        {
+            ServerLog(hottest, "Error removing connection from epoll: %s", strerror(errno));
+            break;
+        }
+
+        if (hottest->prev)
+        {
+            hottest->prev->next = hottest->next;
+        }
+        else
+        {
+            worker->connections = hottest->next;
+        }
+        if (hottest->next)
+        {
+            hottest->next->prev = hottest->prev;
+        }
+        hottest->prev = hottest->next = NULL;
+
+        moved += hottest->windowBytes;
+        hottest->windowId = 0;
+        hottest->migratedAt = now;
+        atomic_fetch_sub_explicit(&worker->stats.connections, 1, memory_order_relaxed);
+        STAT_ADD(worker, migratedOut, 1);
+        ECHO_PROBE5(migrate, hottest->fd, worker->id, target->id,
+                    hottest->echo.bytesReceived - hottest->echo.bytesSent, NowNs());
+
+        PushHandoff(target, hottest);
+    }
+}
+
+void BalanceWorker(WORKER *worker, uint64_t busyNs, uint64_t windowNs, uint64_t now)
+{
+    SERVER *server = worker->server;
+    unsigned utilisation = (unsigned)(busyNs * 1000 / (windowNs ? windowNs : 1));
+
+    atomic_store_explicit(&worker->utilisation, utilisation, memory_order_relaxed);
+
+    if (server->balance && server->nWorkers > 1)
+    {
+        worker->busyWindows = utilisation >= BUSY_THRESHOLD ? worker->busyWindows + 1 : 0;
+
+        if (worker->busyWindows >= BUSY_WINDOWS)
+        {
+            WORKER *target = NULL;
+            unsigned targetUtilisation = IDLE_THRESHOLD;
+
+            for (int w = 0; w < server->nWorkers; w++)
+            {
+                WORKER *peer = &server->workers[w];
+                unsigned peerUtilisation = atomic_load_explicit(&peer->utilisation, memory_order_relaxed);
+                if (peer != worker && peerUtilisation < targetUtilisation)
+                {
+                    target = peer;
+                    targetUtilisation = peerUtilisation;
+                }
+            }
+
+            if (target)
+            {
+                // move load until both workers meet halfway. Echoed bytes are the load estimator.
+                uint64_t bytesToMove = worker->windowBytes * (utilisation - targetUtilisation) / (2 * utilisation);
+                MigrateHotConnections(worker, target, bytesToMove, now);
+                worker->busyWindows = 0;
+            }
+        }
+    }
+
+    worker->windowId++;
+    worker->windowBytes = 0;
+}
+
+// Worker code. Server main logic.
+void *ServerWorkerThread(void *parameter)
+{
+    WORKER *worker = (WORKER *)parameter;
+    SERVER *server = worker->server;
+    struct epoll_event events[MAX_EVENTS];
+    int maxEvents = server->shared ? SHARED_MAX_EVENTS : MAX_EVENTS;
+    uint64_t windowStart = NowNs();
+    uint64_t busyNs = 0;
+
+    /*
+        Each worker is an independent reactor. When epoll reports an event:
+
+        1 - Listener readable: accept new connections. They stay in this worker.
+
+        2 - Control eventfd readable: adopt connections handed off by other workers,
+            or exit when server is finishing.
+
+        3 - Client readable: receive data and send it back. If send is partial,
+            connection waits for EPOLLOUT and stops reading until all data is sent.
+
+        4 - Client writable: send what remains, and read again when done.
+
+        At the end of each balance window the worker publishes its utilisation, and if it
+        stays busy it migrates its hottest connections to the least loaded worker.
+
+        In shared queue mode all workers wait on the same epoll instance and take one event
+        at a time. Control eventfd is only used for shutdown and there is no migration.
+    */
+
+    if (server->perf)
+    {
+        // counters follow this thread only, so each worker measures its own share of the work.
+        if (PerfCountersOpen(&worker->perf, gPerfSpecs, N_PERF_SPECS) == 0 && worker->id == 0)
+        {
+            fprintf(stderr, "Hardware counters not available (see /proc/sys/kernel/perf_event_paranoid)\n");
+        }
+        PerfCountersEnable(&worker->perf);
+        atomic_store(&worker->perfReady, 1);
+    }
+
+    while (!atomic_load(&server->finish))
+    {
+        uint64_t windowEnd = windowStart + BALANCE_INTERVAL_MS * NS_PER_MS;
+        uint64_t now = NowNs();
+        int timeout = now >= windowEnd ? 0 : (int)((windowEnd - now + NS_PER_MS - 1) / NS_PER_MS);
+
+        if (worker->nextResumeMs)
+        {
+            uint64_t nowMs = AdmissionNowMs(server->admission);
+            if (worker->nextResumeMs <= nowMs)
+            {
+                ResumeConnections(worker, nowMs);
+            }
+            if (worker->nextResumeMs && worker->nextResumeMs - nowMs < (uint64_t)timeout)
+            {
+                timeout = (int)(worker->nextResumeMs - nowMs);
+            }
+        }
+
+        int nEvents = epoll_wait(worker->epollFd, events, maxEvents, timeout);
+        uint64_t wakeup = NowNs();
+
+        if (nEvents < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            PError("epoll error in worker thread");
+            break;
+        }
+
+        int work = 0;
+        for (int i = 0; i < nEvents; i++)
+        {
+            CONNECTION *connection = (CONNECTION *)events[i].data.ptr;
+
+            switch (connection->type)
+            {
+            case SERVER_TYPE:
+                work += AcceptConnections(worker, connection);
+                if (server->shared)
+                {
+                    RearmListener(worker, connection);
+                }
+                break;
+            case CONTROL_TYPE:
+                // shared control eventfd is never read, so it keeps waking workers until all of them exit.
+                if (!server->shared)
+                {
+                    ProcessHandoffs(worker);
+                }
+                work++;
+                break;
+            case CLIENT_TYPE:
+                work += ProcessClientEvent(worker, connection, events[i].events);
+                break;
+            }
+        }
+        if (nEvents > 0)
+        {
+            STAT_ADD(worker, wakeups, 1);
+            if (!work)
+            {
+                STAT_ADD(worker, emptyWakeups, 1);
+            }
+        }
+
+        now = NowNs();
+        busyNs += now - wakeup;
+        if (now >= windowEnd)
+        {
+            BalanceWorker(worker, busyNs, now - windowStart, now);
+            windowStart = now;
+            busyNs = 0;
+        }
+    }
+
+    if (atomic_load(&worker->perfReady))
+    {
+        PerfCountersDisable(&worker->perf);
+    }
+    return NULL;
+}
+
+void PrintServerStats(SERVER *server)
+{
+    printf("worker,connections,accepted,echoed_on_accept,rejected,closed,messages,bytes,partial_sends,paused,migrated_out,migrated_in,restored,"
+           "wakeups,empty_wakeups,lock_acquires,lock_contended,lock_wait_us,utilisation\n");
+    for (int w = 0; w < server->nWorkers; w++)
+    {
+        WORKER *worker = &server->workers[w];
+        printf("%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+               ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.1f%%\n",
+               worker->id,
+               STAT_GET(worker, connections),
+               STAT_GET(worker, accepted),
+               STAT_GET(worker, echoedOnAccept),
+               STAT_GET(worker, rejected),
+               STAT_GET(worker, closed),
+               STAT_GET(worker, messages),
+               STAT_GET(worker, bytesEchoed),
+               STAT_GET(worker, partialSends),
+               STAT_GET(worker, paused),
+               STAT_GET(worker, migratedOut),
+               STAT_GET(worker, migratedIn),
+               STAT_GET(worker, restored),
+               STAT_GET(worker, wakeups),
+               STAT_GET(worker, emptyWakeups),
+               STAT_GET(worker, lockAcquires),
+               STAT_GET(worker, lockContended),
+               STAT_GET(worker, lockWaitNs) / 1000,
+               atomic_load_explicit(&worker->utilisation, memory_order_relaxed) / 10.0);
+    }
+    fflush(stdout);
+
+    if (server->perf)
+    {
+        PrintPerfStats(server);
+    }
+}
+
+// Events per message and per KB echoed, one row per worker and event, so tables of several runs can be joined.
+void PrintPerfStats(SERVER *server)
+{
+    uint64_t totals[PERF_MAX_COUNTERS];
+    uint64_t totalMessages = 0;
+    uint64_t totalBytes = 0;
+    char workerId[16];
+
+    for (int i = 0; i < N_PERF_SPECS; i++)
+    {
+        totals[i] = 0;
+    }
+
+    printf("worker,event,total,per_message,per_kb\n");
+    for (int w = 0; w < server->nWorkers; w++)
+    {
+        WORKER *worker = &server->workers[w];
+        uint64_t values[PERF_MAX_COUNTERS];
+
+        if (!atomic_load(&worker->perfReady))
+            continue;
+
+        uint64_t messages = STAT_GET(worker, messages);
+        uint64_t bytes = STAT_GET(worker, bytesEchoed);
+
+        // counters keep running while read, so a report on SIGUSR1 is a snapshot.
+        PerfCountersRead(&worker->perf, values);
+        snprintf(workerId, sizeof(workerId), "%d", worker->id);
+        for (int i = 0; i < N_PERF_SPECS; i++)
+        {
+            PrintPerfRow(workerId, gPerfSpecs[i].name, values[i], messages, bytes);
+            if (values[i] == PERF_NOT_AVAILABLE || totals[i] == PERF_NOT_AVAILABLE)
+            {
+                totals[i] = PERF_NOT_AVAILABLE;
+            }
+            else
+            {
+                totals[i] += values[i];
+            }
+        }
+        totalMessages += messages;
+        totalBytes += bytes;
+    }
+    for (int i = 0; i < N_PERF_SPECS; i++)
+    {
+        PrintPerfRow("all", gPerfSpecs[i].name, totals[i], totalMessages, totalBytes);
+    }
+    fflush(stdout);
+}
+
+void PrintPerfRow(const char *worker, const char *event, uint64_t value, uint64_t messages, uint64_t bytes)
+{
+    if (value == PERF_NOT_AVAILABLE)
+    {
+        printf("%s,%s,n/a,n/a,n/a\n", worker, event);
+        return;
+    }
+
+    printf("%s,%s,%" PRIu64 ",", worker, event, value);
+    if (messages)
+    {
+        printf("%.2f,", (double)value / messages);
+    }
+    else
+    {
+        printf("n/a,");
+    }
+    if (bytes)
+    {
+        printf("%.2f\n", (double)value * 1024 / bytes);
+    }
+    else
+    {
+        printf("n/a\n");
+    }
+}
+
+int StartRestartListener(SERVER *server, const char *path)
+{
+    server->restartListener = RestartListen(path);
+    if (server->restartListener < 0)
+        return -1;
+
+    strncpy(server->restartPath, path, UNIX_PATH_MAX - 1);
+    if (pthread_create(&server->restartThread, NULL, RestartListenerThread, server) != 0)
+    {
+        close(server->restartListener);
+        server->restartListener = -1;
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+void StopRestartListener(SERVER *server)
+{
+    if (server->restartListener < 0)
+        return;
+
+    // wakes up the restart thread if it is waiting in accept.
+    shutdown(server->restartListener, SHUT_RDWR);
+    pthread_join(server->restartThread, NULL);
+    close(server->restartListener);
+    server->restartListener = -1;
+
+    // after a hot restart the path belongs to the new process.
+    if (atomic_load(&server->restartSocket) < 0)
+    {
+        unlink(server->restartPath);
+    }
+}
+
+// Waits for a new process. Once it is accepting on the listeners, stops this server, so main thread hands off connections.
+void *RestartListenerThread(void *parameter)
+{
+    SERVER *server = (SERVER *)parameter;
+
+    while (!atomic_load(&server->finish))
+    {
+        RESTART_HEADER header;
+        int fds[RESTART_MAX_FDS];
+        int nFds;
+
+        int restartSocket = accept4(server->restartListener, NULL, NULL, SOCK_CLOEXEC);
+        if (restartSocket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        puts("Hot restart requested");
+        if (SendListeners(server, restartSocket) == 0 &&
+            RestartReceive(restartSocket, &header, NULL, 0, fds, &nFds) >= 0 && header.type == RESTART_READY)
+        {
+            StopAccepting(server);
+            atomic_store(&server->restartSocket, restartSocket);
+            kill(getpid(), SIGTERM);
+            break;
+        }
+
+        // new process failed before accepting connections. Keep serving.
+        fprintf(stderr, "Hot restart aborted: new process is not ready\n");
+        close(restartSocket);
+    }
+    return NULL;
+}
+
+int SendListeners(SERVER *server, int restartSocket)
+{
+    RESTART_HEADER header;
+    int fds[MAX_LISTENERS];
+
+    memset(&header, 0, sizeof(header));
+    header.type = RESTART_LISTENERS;
+    // new process removes the unix socket at exit now.
+    memcpy(header.unixSocketPath, server->unixSocketPath, sizeof(header.unixSocketPath));
+    for (int i = 0; i < server->nListeners; i++)
+    {
+        fds[i] = server->listeners[i].fd;
+    }
+    return RestartSend(restartSocket, &header, NULL, 0, fds, server->nListeners);
+}
+
+// returns number of listeners received, or -1.
+int ReceiveListeners(int restartSocket, int *listenSockets, char *unixSocketPath)
+{
+    RESTART_HEADER header;
+    int fds[RESTART_MAX_FDS];
+    int nFds;
+
+    if (RestartReceive(restartSocket, &header, NULL, 0, fds, &nFds) < 0)
+        return -1;
+
+    if (header.type != RESTART_LISTENERS || nFds == 0 || nFds > MAX_LISTENERS)
+    {
+        for (int i = 0; i < nFds; i++)
+        {
+            close(fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(listenSockets, fds, sizeof(int) * nFds);
+    memcpy(unixSocketPath, header.unixSocketPath, UNIX_PATH_MAX);
+    unixSocketPath[UNIX_PATH_MAX - 1] = '\0';
+    return nFds;
+}
+
+// Listeners are shared with the new process, which accepts all new connections from now on.
+void StopAccepting(SERVER *server)
+{
+    for (int i = 0; i < server->nListeners; i++)
+    {
+        if (server->shared)
+        {
+            epoll_ctl(server->epollFd, EPOLL_CTL_DEL, server->listeners[i].fd, NULL);
+            continue;
+        }
+        for (int w = 0; w < server->nWorkers; w++)
+        {
+            epoll_ctl(server->workers[w].epollFd, EPOLL_CTL_DEL, server->listeners[i].fd, NULL);
+        }
+    }
+}
+
+int SendConnection(int restartSocket, CONNECTION *connection)
+{
+    RESTART_HEADER header;
+
+    memset(&header, 0, sizeof(header));
+    header.type = RESTART_CONNECTION;
+    header.pendingBytes = (uint32_t)(connection->echo.bytesReceived - connection->echo.bytesSent);
+    header.bytesEchoed = connection->bytesEchoed;
+    memcpy(&header.address, &connection->clientAddr, sizeof(header.address));
+    return RestartSend(restartSocket, &header, connection->echo.buffer + connection->echo.bytesSent,
+                       header.pendingBytes, &connection->fd, 1);
+}
+
+// Called once workers are stopped. Connections are closed later here, but new process keeps them open.
+void HandOffConnections(SERVER *server, int restartSocket)
+{
+    RESTART_HEADER header;
+    int handedOff = 0;
+    int failed = 0;
+
+    for (int w = 0; w < server->nWorkers; w++)
+    {
+        WORKER *worker = &server->workers[w];
+
+        for (CONNECTION *c = worker->connections; c; c = c->next)
+        {
+            SendConnection(restartSocket, c) == 0 ? handedOff++ : failed++;
+        }
+        // connections migrating between workers when they stopped.
+        for (CONNECTION *c = atomic_load(&worker->handoffHead); c; c = c->handoffNext)
+        {
+            SendConnection(restartSocket, c) == 0 ? handedOff++ : failed++;
+        }
+    }
+    for (CONNECTION *c = server->connections; c; c = c->next)
+    {
+        SendConnection(restartSocket, c) == 0 ? handedOff++ : failed++;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.type = RESTART_DONE;
+    if (RestartSend(restartSocket, &header, NULL, 0, NULL, 0) < 0)
+    {
+        PError("Error finishing hot restart");
+    }
+    printf("Hot restart: %d connections handed off, %d failed\n", handedOff, failed);
+
+    // unix socket file is removed by the new process.
+    server->unixSocketPath[0] = '\0';
+}
+
+void RestoreConnection(SERVER *server, int target, const RESTART_HEADER *header, int clientSocket, const char *pending)
+{
+    WORKER *worker = &server->workers[target];
+    CONNECTION *connection = (CONNECTION *)calloc(1, sizeof(CONNECTION));
+
+    connection->type = CLIENT_TYPE;
+    connection->fd = clientSocket;
+    EchoStateInit(&connection->echo);
+    // unsent bytes are echoed before reading again.
+    memcpy(connection->echo.buffer, pending, header->pendingBytes);
+    connection->echo.bytesReceived = header->pendingBytes;
+    connection->echo.waitingSend = header->pendingBytes > 0;
+    memcpy(&connection->clientAddr, &header->address, sizeof(connection->clientAddr));
+    FormatSockAddr((struct sockaddr *)&connection->clientAddr, connection->addressStr, MAX_ADDR_STR);
+    connection->bytesEchoed = header->bytesEchoed;
+    connection->acceptedBy = target;
+    if (server->capture)
+    {
+        connection->captureId = CaptureConnectionOpen(server->capture);
+    }
+    if (server->admission)
+    {
+        connection->admission = AdmissionLookup(server->admission, (struct sockaddr *)&connection->clientAddr,
+                                                AdmissionNowMs(server->admission));
+    }
+    atomic_fetch_add(&server->nClients, 1);
+
+    if (!server->shared)
+    {
+        // worker adopts it like a migrated connection.
+        PushHandoff(worker, connection);
+        return;
+    }
+
+    pthread_mutex_lock(&server->connectionsLock);
+    connection->next = server->connections;
+    if (server->connections)
+    {
+        server->connections->prev = connection;
+    }
+    server->connections = connection;
+    pthread_mutex_unlock(&server->connectionsLock);
+    atomic_fetch_add_explicit(&worker->stats.connections, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&worker->stats.restored, 1, memory_order_relaxed);
+
+    if (ArmConnection(worker, connection, EPOLL_CTL_ADD, connection->echo.waitingSend ? EPOLLOUT : EPOLLIN) < 0)
+    {
+        ServerLog(connection, "Error adopting restored connection: %s. Closing connection", strerror(errno));
+        UnregisterClient(worker, connection);
+    }
+}
+
+// Receives connections of previous process until it is done. Returns connections restored.
+int RestoreConnections(SERVER *server, int restartSocket)
+{
+    RESTART_HEADER header;
+    char pending[DATA_BUFSIZE];
+    int fds[RESTART_MAX_FDS];
+    int nFds;
+    int restored = 0;
+
+    while (1)
+    {
+        ssize_t payloadLen = RestartReceive(restartSocket, &header, pending, sizeof(pending), fds, &nFds);
+        if (payloadLen < 0)
+        {
+            PError("Error receiving connections from previous process");
+            return restored;
+        }
+        if (header.type == RESTART_DONE)
+        {
+            return restored;
+        }
+        if (header.type != RESTART_CONNECTION || nFds != 1 || payloadLen != header.pendingBytes)
+        {
+            for (int i = 0; i < nFds; i++)
+            {
+                close(fds[i]);
+            }
+            continue;
+        }
+        // spread connections across workers. Balancing moves them later if needed.
+        RestoreConnection(server, restored % server->nWorkers, &header, fds[0], pending);
+        restored++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int serverPort;
+    const char *unixSocketPath;
+    const char *restartPath;
+    int perf;
+    const char *capturePath;
+    int captureFlags;
+    int fastSetup;
+    char inheritedUnixPath[UNIX_PATH_MAX];
+    int restartSocket;
+    int listenSockets[MAX_LISTENERS];
+    int nListeners;
+    int nWorkers;
+    int balance;
+    int shared;
+    unsigned connRate, connBurst, byteRate, byteBurst;
+    int opt;
+    sigset_t signals;
+    SERVER *server;
+
+    nWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    balance = 1;
+    shared = 0;
+    restartPath = NULL;
+    perf = 0;
+    capturePath = NULL;
+    captureFlags = 0;
+    fastSetup = 1;
+    connRate = connBurst = byteRate = byteBurst = 0;
+
+    while ((opt = getopt(argc, argv, "w:nsc:b:R:PC:dFh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            nWorkers = atoi(optarg);
+            break;
+        case 'n':
+            balance = 0;
+            break;
+        case 's':
+            shared = 1;
+            break;
+        case 'c':
+            // burst defaults to one second of rate.
+            if (sscanf(optarg, "%u:%u", &connRate, &connBurst) < 2)
+                connBurst = connRate;
+            break;
+        case 'b':
+            if (sscanf(optarg, "%u:%u", &byteRate, &byteBurst) < 2)
+                byteBurst = byteRate;
+            break;
+        case 'R':
+            restartPath = optarg;
+            break;
+        case 'P':
+            perf = 1;
+            break;
+        case 'C':
+            capturePath = optarg;
+            break;
+        case 'd':
+            captureFlags |= CAPTURE_PAYLOADS;
+            break;
+        case 'F':
+            fastSetup = 0;
+            break;
+        default:
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    serverPort = atoi(argv[optind]);
+
+    if (serverPort <= 0)
+    {
+        fprintf(stderr, "Invalid port number\n");
+        return EXIT_FAILURE;
+    }
+
+    if (nWorkers <= 0 || nWorkers > MAX_WORKERS)
+    {
+        fprintf(stderr, "Workers must be between 1 and %d\n", MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+
+    unixSocketPath = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+    // hot restart: if a server is running, its listeners are used instead of creating new ones.
+    restartSocket = restartPath ? RestartConnect(restartPath) : -1;
+    if (restartSocket >= 0)
+    {
+        nListeners = ReceiveListeners(restartSocket, listenSockets, inheritedUnixPath);
+        if (nListeners < 0)
+        {
+            PError("Error receiving listeners from running server");
+            close(restartSocket);
+            return EXIT_FAILURE;
+        }
+        unixSocketPath = inheritedUnixPath[0] ? inheritedUnixPath : NULL;
+        puts("Hot restart: listeners received from running server");
+    }
+    else
+    {
+        nListeners = 0;
+        listenSockets[nListeners] = CreateTcpListener(serverPort, fastSetup);
+        if (listenSockets[nListeners] < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        nListeners++;
+
+        if (unixSocketPath)
+        {
+            listenSockets[nListeners] = CreateUnixListener(unixSocketPath);
+            if (listenSockets[nListeners] < 0)
+            {
+                close(listenSockets[0]);
+                return EXIT_FAILURE;
+            }
+            nListeners++;
+        }
+    }
+
+    // Signals are handled synchronously by main thread. Workers inherit the blocked mask.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    server = CreateServer(listenSockets, nListeners, unixSocketPath, balance, shared);
+    server->fastSetup = fastSetup;
+
+    if (perf)
+    {
+        // each syscall entry, counted by tracepoint. Needs tracefs access, so it is often not available.
+        gPerfSpecs[PERF_SYSCALLS_SPEC].config = PerfTracepointId("raw_syscalls", "sys_enter");
+        server->perf = 1;
+    }
+
+    if (capturePath)
+    {
+        server->capture = CaptureOpen(capturePath, captureFlags);
+        if (!server->capture)
+        {
+            PError("Error creating capture file");
+            CloseServer(server);
+            return EXIT_FAILURE;
+        }
+        printf("Recording traffic to %s%s\n", capturePath, captureFlags & CAPTURE_PAYLOADS ? " (with payloads)" : "");
+    }
+
+    if (connRate || byteRate)
+    {
+        server->admission = AdmissionCreate(connRate, connBurst, byteRate, byteBurst);
+        if (!server->admission)
+        {
+            fprintf(stderr, "Error creating admission table\n");
+            CloseServer(server);
+            return EXIT_FAILURE;
+        }
+        printf("Admission per client address: %u connections/s (burst %u), %u bytes/s (burst %u)\n",
+               connRate, connBurst, byteRate, byteBurst);
+    }
+
+    if (!CreateWorkers(server, nWorkers))
+    {
+        fprintf(stderr, "Error creating all workers. Exiting.\n");
+        if (restartSocket >= 0)
+        {
+            // running server keeps serving. Do not remove its unix socket.
+            server->unixSocketPath[0] = '\0';
+            close(restartSocket);
+        }
+        CloseServer(server);
+        return EXIT_FAILURE;
+    }
+
+    if (restartSocket >= 0)
+    {
+        // workers are accepting on the inherited listeners, so previous process can stop.
+        RESTART_HEADER header;
+        memset(&header, 0, sizeof(header));
+        header.type = RESTART_READY;
+        if (RestartSend(restartSocket, &header, NULL, 0, NULL, 0) < 0)
+        {
+            PError("Error notifying running server");
+        }
+        else
+        {
+            printf("Hot restart: %d connections restored\n", RestoreConnections(server, restartSocket));
+        }
+        close(restartSocket);
+    }
+
+    if (restartPath && StartRestartListener(server, restartPath) < 0)
+    {
+        PError("Error creating hot restart socket");
+    }
+
+    printf("%s\nServer listening on port %d. Workers: %d (%s)\n", PROGRAM_VERSION, serverPort, server->nWorkers,
+           shared ? "shared queue" : "reactor per worker");
+    if (unixSocketPath)
+    {
+        printf("Server listening on unix socket %s\n", unixSocketPath);
+    }
+    fflush(stdout);
+
+    while (!atomic_load(&server->finish))
+    {
+        int signal;
+        if (sigwait(&signals, &signal) != 0)
+            continue;
+
+        if (signal == SIGUSR1)
+        {
+            PrintServerStats(server);
+        }
+        else
+        {
+            puts("Closing server...");
+            atomic_store(&server->finish, 1);
+        }
+    }
+
+    for (int w = 0; w < (shared ? 1 : server->nWorkers); w++)
+    {
+        uint64_t wake = 1;
+        if (write(shared ? server->control.fd : server->workers[w].control.fd, &wake, sizeof(wake)) < 0)
+        {
+            PError("Error waking up worker");
+        }
+    }
+    for (int w = 0; w < server->nWorkers; w++)
+    {
+        pthread_join(server->workers[w].thread, NULL);
+    }
+
+    StopRestartListener(server);
+    restartSocket = atomic_load(&server->restartSocket);
+    if (restartSocket >= 0)
+    {
+        HandOffConnections(server, restartSocket);
+        close(restartSocket);
+        // connections live on in the new process, so they are not recorded as closed.
+        CaptureClose(server->capture);
+        server->capture = NULL;
+    }
+
+    PrintServerStats(server);
+    CloseServer(server);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+/*
+    perf-counters.c
+
+    Thin wrapper over perf_event_open(2). See perf-counters.h.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf-counters.h"
+
+// returns the number of counters available.
+int PerfCountersOpen(PERF_COUNTERS *counters, const PERF_COUNTER_SPEC *specs, int nSpecs)
+{
+    int available = 0;
+
+    counters->nCounters = nSpecs < PERF_MAX_COUNTERS ? nSpecs : PERF_MAX_COUNTERS;
+    for (int i = 0; i < counters->nCounters; i++)
+    {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = specs[i].type;
+        attr.config = specs[i].config;
+        attr.disabled = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // calling thread, any cpu.
+        counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (counters->fds[i] < 0 && (specs[i].type == PERF_TYPE_HARDWARE || specs[i].type == PERF_TYPE_HW_CACHE))
+        {
+            // kernel events need perf_event_paranoid < 2. Try again counting user space only.
+            // Software and tracepoint events happen in the kernel, so they would always count 0.
+            attr.exclude_kernel = 1;
+            counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (counters->fds[i] >= 0)
+        {
+            available++;
+        }
+    }
+    return available;
+}
+
+void PerfCountersEnable(PERF_COUNTERS *counters)
+{
+    for (int i = 0; i < counters->nCounters; i++)
+    {
+        if (counters->fds[i] >= 0)
+        {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void PerfCountersDisable(PERF_COUNTERS *counters)
+{
+    for (int i = 0; i < counters->nCounters; i++)
+    {
+        if (counters->fds[i] >= 0)
+        {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+void PerfCountersRead(PERF_COUNTERS *counters, uint64_t *values)
+{
+    for (int i = 0; i < counters->nCounters; i++)
+    {
+        uint64_t data[3]; // value, time enabled, time running
+
+        values[i] = PERF_NOT_AVAILABLE;
+        if (counters->fds[i] < 0 || read(counters->fds[i], data, sizeof(data)) != sizeof(data))
+        {
+            continue;
+        }
+        // scale when the PMU was multiplexed between more events than hardware counters.
+        if (data[2] == 0)
+        {
+            values[i] = 0;
+        }
+        else
+        {
+            values[i] = data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+        }
+    }
+}
+
+void PerfCountersClose(PERF_COUNTERS *counters)
+{
+    for (int i = 0; i < counters->nCounters; i++)
+    {
+        if (counters->fds[i] >= 0)
+        {
+            close(counters->fds[i]);
+        }
+        counters->fds[i] = -1;
+    }
+}
+
+// config of a PERF_TYPE_TRACEPOINT event, or PERF_NOT_AVAILABLE if tracefs is not mounted or readable.
+uint64_t PerfTracepointId(const char *subsystem, const char *event)
+{
+    static const char *tracefs[] = {"/sys/kernel/tracing", "/sys/kernel/debug/tracing"};
+
+    for (size_t i = 0; i < sizeof(tracefs) / sizeof(tracefs[0]); i++)
+    {
+        char path[256];
+        uint64_t id;
+
+        snprintf(path, sizeof(path), "%s/events/%s/%s/id", tracefs[i], subsystem, event);
+        FILE *file = fopen(path, "r");
+        if (!file)
+            continue;
+
+        int found = fscanf(file, "%" SCNu64, &id) == 1;
+        fclose(file);
+        if (found)
+            return id;
+    }
+    return PERF_NOT_AVAILABLE;
+}
@@ -0,0 +1,39 @@
+/*
+    perf-counters.h
+
+    Thin wrapper over perf_event_open(2) to count hardware and software events of the
+    calling thread. Counters that the kernel refuses (no PMU, perf_event_paranoid, containers)
+    are reported as not available instead of failing.
+
+    author: Alejandro Ambroa (jandroz@gmail.com)
+*/
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+
+#define PERF_MAX_COUNTERS 8
+#define PERF_NOT_AVAILABLE UINT64_MAX
+
+typedef struct
+{
+    uint32_t type;   // PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE...
+    uint64_t config; // PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES...
+    const char *name;
+} PERF_COUNTER_SPEC;
+
+typedef struct
+{
+    int fds[PERF_MAX_COUNTERS];
+    int nCounters;
+} PERF_COUNTERS;
+
+int PerfCountersOpen(PERF_COUNTERS *counters, const PERF_COUNTER_SPEC *specs, int nSpecs);
+void PerfCountersEnable(PERF_COUNTERS *counters);
+void PerfCountersDisable(PERF_COUNTERS *counters);
+void PerfCountersRead(PERF_COUNTERS *counters, uint64_t *values);
+void PerfCountersClose(PERF_COUNTERS *counters);
+uint64_t PerfTracepointId(const char *subsystem, const char *event);
+
+#endif
@@ -7,6 +7,12 @@
 
     author: Alejandro Ambroa (jandroz@gmail.com)
 
+    Optional per client address admission control: a connection rate token bucket checked by
+    the WSAAccept condition function (before the handshake completes), and a byte rate token
+    bucket which delays the next read of connections echoing too fast.
+
+    Listener enables TCP Fast Open, so returning clients send their first request with the SYN.
+
     To compile (using Visual Studio command prompt):
     cl /W4 winsock2-iocp-thread.c /link ws2_32.lib
 
@@ -18,24 +24,63 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 
-#define PROGRAM_VERSION "v1.0.0"
+#define PROGRAM_VERSION "v1.3.0"
 
 #define DATA_BUFSIZE 2048
 #define MAX_CLIENTS 15000
 #define MAX_WORKERS 16
+#define MAX_LISTENERS 2
 #define MAX_BUF_WIN_STR_ERROR 64
+#define MAX_ADDR_STR (INET6_ADDRSTRLEN + 8 > UNIX_PATH_MAX + 5 ? INET6_ADDRSTRLEN + 8 : UNIX_PATH_MAX + 5)
+#define ADMISSION_TABLE_SIZE 16384 // must be a power of 2
+#define ADMISSION_MAX_PROBES 32
+#define ADMISSION_IDLE_MS 60000 // entries idle for longer and without holders can be reused by other addresses
+#define ADMISSION_CLAIMING ((LONG64)-1) // key of an entry being filled, by its first lookup or a reuse.
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 15 // ws2ipdef.h, Windows 10 1607 and later.
+#endif
+
+#define BUCKET_TIME(bucket) ((DWORD)((ULONGLONG)(bucket) >> 32))
+#define BUCKET_TOKENS(bucket) ((DWORD)(bucket))
+#define BUCKET(time, tokens) ((LONG64)(((ULONGLONG)(DWORD)(time) << 32) | (DWORD)(tokens)))
 
 //#pragma comment(lib, "ws2_32")
 
 enum OVERLAPPED_EVENT_TYPE
 {
     EVENT_READ,
-    EVENT_SEND
+    EVENT_SEND,
+    EVENT_RESUME_READ
 };
 
+/*
+    Token buckets of a client address, packed in 64 bits and updated with InterlockedCompareExchange64:
+    high 32 bits are the last refill time (ms) and low 32 bits the tokens
+    (milli-connections, or bytes as a signed value to keep the debt).
+*/
+typedef struct
+{
+    volatile LONG64 key; // hash of the address, 0 is a free entry.
+    volatile LONG64 connBucket;
+    volatile LONG64 byteBucket;
+    volatile LONG holders; // lookups not released yet: connections of the address spending its buckets.
+} ADMISSION_ENTRY, *LPADMISSION_ENTRY;
+
+typedef struct
+{
+    DWORD connRate; // connections per second, 0 is unlimited.
+    DWORD connBurst;
+    DWORD byteRate; // bytes per second, 0 is unlimited.
+    DWORD byteBurst;
+    ULONGLONG startMs;
+    LPADMISSION_ENTRY entries;
+} ADMISSION_TABLE, *LPADMISSION_TABLE;
+
 typedef struct
 {
     OVERLAPPED overlapped;
@@ -49,43 +94,72 @@ typedef struct
 {
     EOVERLAPPED overlapped;
     SOCKET socket;
-    SOCKADDR_IN clientAddr;
+    SOCKADDR_STORAGE clientAddr;
     WSABUF wsaBuf;
-    char addressStr[INET_ADDRSTRLEN]; // help with logging
-    USHORT port;
+    char addressStr[MAX_ADDR_STR]; // help with logging
+    LPADMISSION_ENTRY admission;   // NULL if address is not limited.
+    DWORD readDelayMs;             // wait before next read, set when byte rate is exceeded.
+    HANDLE resumeTimer;            // set under server critical section. Deleted on next arm or unregister.
 } CLIENT_INFO, *LPCLIENT_INFO;
 
 typedef struct
 {
     INT nClients;
-    SOCKET listenSocket;
+    WSAPOLLFD listenFds[MAX_LISTENERS];
+    INT nListeners;
+    CHAR unixSocketPath[UNIX_PATH_MAX];
     HANDLE completionPort;
     CRITICAL_SECTION criticalSection;
     LPCLIENT_INFO *clients;
+    LPADMISSION_TABLE admission; // NULL if admission control is disabled.
 } SERVER_INFO, *LPSERVER_INFO;
 
+typedef struct
+{
+    LPSERVER_INFO serverInfo;
+    LPADMISSION_ENTRY admission; // entry of the address accepted by condition function.
+} ACCEPT_CONTEXT, *LPACCEPT_CONTEXT;
+
 INT CreateWorkerThreads(LPSERVER_INFO lpServerInfo);
 DWORD WINAPI ServerWorkerThread(LPVOID completionPort);
-LPSERVER_INFO CreateServer(SOCKET listenSocket);
-LPCLIENT_INFO RegisterClient(LPSERVER_INFO lpServerInfo, SOCKET clientSocket, LPSOCKADDR_IN clientSockaddr, int remoteLen);
+SOCKET CreateTcpListener(INT port, char *winErrorMsgBuffer);
+SOCKET CreateUnixListener(const char *path, char *winErrorMsgBuffer);
+LPSERVER_INFO CreateServer(SOCKET *listenSockets, INT nListeners, const char *unixSocketPath);
+LPCLIENT_INFO RegisterClient(LPSERVER_INFO lpServerInfo, SOCKET clientSocket, LPSOCKADDR clientSockaddr, int remoteLen, LPADMISSION_ENTRY admission);
 void UnregisterClient(LPSERVER_INFO lpServerInfo, LPCLIENT_INFO clientInfo);
 void CloseServer(LPSERVER_INFO lpServerInfo);
 INT GetNumClients(LPSERVER_INFO lpServerInfo);
 BOOL WINAPI CtrlHandler(DWORD fdwCtrlType);
 void Cleanup();
+void AcceptClient(LPSERVER_INFO serverInfo, SOCKET listenSocket, char *winErrorMsgBuffer);
 void Usage(const char *programName);
 char *StrWinError(DWORD errorCode, char *winErrorMsgBuffer);
 void PWError(const char *mainMsg, char *winErrorMsgBuffer);
+char *FormatSockAddr(const SOCKADDR *addr, char *addrStrBuffer, size_t bufferLen);
 BOOL OverlappedOperationError(DWORD overlappedResultCode, LPDWORD wsaError);
+LPADMISSION_TABLE AdmissionCreate(DWORD connRate, DWORD connBurst, DWORD byteRate, DWORD byteBurst);
+void AdmissionFree(LPADMISSION_TABLE table);
+ULONGLONG AdmissionNowMs(LPADMISSION_TABLE table);
+LPADMISSION_ENTRY AdmissionLookup(LPADMISSION_TABLE table, const SOCKADDR *addr, ULONGLONG nowMs);
+void AdmissionRelease(LPADMISSION_ENTRY entry);
+BOOL AdmissionAcquireConnection(LPADMISSION_TABLE table, LPADMISSION_ENTRY entry, ULONGLONG nowMs);
+DWORD AdmissionConsumeBytes(LPADMISSION_TABLE table, LPADMISSION_ENTRY entry, DWORD bytes, ULONGLONG nowMs);
+int CALLBACK AcceptCondition(LPWSABUF lpCallerId, LPWSABUF lpCallerData, LPQOS lpSQOS, LPQOS lpGQOS,
+                             LPWSABUF lpCalleeId, LPWSABUF lpCalleeData, GROUP FAR *g, DWORD_PTR dwCallbackData);
+VOID CALLBACK ResumeReadTimer(PVOID lpParameter, BOOLEAN timerOrWaitFired);
+BOOL ParseRate(const char *arg, DWORD *rate, DWORD *burst);
 
 #define _STRG(a) a
-#define LOG_FORMAT(a) "%s:%d -> " _STRG(a) ".\n"
+#define LOG_FORMAT(a) "%s -> " _STRG(a) ".\n"
 
 LPSERVER_INFO gServerInfo = NULL;
 
 void Usage(const char *programName)
 {
-    printf("%s\nUsage: %s <port>\n", PROGRAM_VERSION, programName);
+    printf("%s\nUsage: %s [-c rate[:burst]] [-b rate[:burst]] <port> [unix socket path]\n"
+           "  -c rate  max new connections per second from each client address\n"
+           "  -b rate  max bytes per second echoed to each client address\n",
+           PROGRAM_VERSION, programName);
 }
 
 char *StrWinError(DWORD errorCode, char *winErrorMsgBuffer)
@@ -108,6 +182,30 @@ void PWError(const char *mainMsg, char *winErrorMsgBuffer)
     fprintf(stderr, "%s : %s (%ld)\n", mainMsg, StrWinError(lastError, winErrorMsgBuffer), lastError);
 }
 
+char *FormatSockAddr(const SOCKADDR *addr, char *addrStrBuffer, size_t bufferLen)
+{
+    char ipStr[INET6_ADDRSTRLEN] = {0};
+
+    switch (addr->sa_family)
+    {
+    case AF_INET:
+        inet_ntop(AF_INET, &((const SOCKADDR_IN *)addr)->sin_addr, ipStr, INET6_ADDRSTRLEN);
+        snprintf(addrStrBuffer, bufferLen, "%s:%d", ipStr, ntohs(((const SOCKADDR_IN *)addr)->sin_port));
+        break;
+    case AF_INET6:
+        inet_ntop(AF_INET6, &((const SOCKADDR_IN6 *)addr)->sin6_addr, ipStr, INET6_ADDRSTRLEN);
+        snprintf(addrStrBuffer, bufferLen, "[%s]:%d", ipStr, ntohs(((const SOCKADDR_IN6 *)addr)->sin6_port));
+        break;
+    case AF_UNIX:
+        // clients connected to an AF_UNIX socket are usually unnamed.
+        snprintf(addrStrBuffer, bufferLen, "unix:%.*s", UNIX_PATH_MAX, ((const SOCKADDR_UN *)addr)->sun_path);
+        break;
+    default:
+        snprintf(addrStrBuffer, bufferLen, "unknown family %d", addr->sa_family);
+    }
+    return addrStrBuffer;
+}
+
 BOOL OverlappedOperationError(DWORD overlappedResultCode, LPDWORD wsaError)
 {
     if (overlappedResultCode == 0)
@@ -121,14 +219,413 @@ BOOL OverlappedOperationError(DWORD overlappedResultCode, LPDWORD wsaError)
     return overlappedResultCode == SOCKET_ERROR && *wsaError != WSA_IO_PENDING;
 }
 
-LPSERVER_INFO CreateServer(SOCKET listenSocket)
+LPADMISSION_TABLE AdmissionCreate(DWORD connRate, DWORD connBurst, DWORD byteRate, DWORD byteBurst)
+{
+    LPADMISSION_TABLE table = (LPADMISSION_TABLE)malloc(sizeof(ADMISSION_TABLE));
+    if (!table)
+        return NULL;
+    ZeroMemory(table, sizeof(ADMISSION_TABLE));
+
+    table->entries = (LPADMISSION_ENTRY)malloc(ADMISSION_TABLE_SIZE * sizeof(ADMISSION_ENTRY));
+    if (!table->entries)
+    {
+        free(table);
+        return NULL;
+    }
+    ZeroMemory(table->entries, ADMISSION_TABLE_SIZE * sizeof(ADMISSION_ENTRY));
+    table->connRate = connRate;
+    // tokens are kept in milli-connections in 32 bits.
+    table->connBurst = connBurst == 0 ? 1 : min(connBurst, MAXDWORD / 1000);
+    table->byteRate = byteRate;
+    table->byteBurst = min(byteBurst, MAXLONG);
+    table->startMs = GetTickCount64();
+    return table;
+}
+
+void AdmissionFree(LPADMISSION_TABLE table)
+{
+    if (!table)
+        return;
+    free(table->entries);
+    free(table);
+}
+
+ULONGLONG AdmissionNowMs(LPADMISSION_TABLE table)
+{
+    return GetTickCount64() - table->startMs;
+}
+
+// Spins, yielding the CPU, while the entry is claimed. A claim lasts a few stores, by the lookup
+// which fills it or a reuse checking holders, but if its thread is preempted readers of the slot wait.
+static LONG64 LoadKey(LPADMISSION_ENTRY entry)
+{
+    LONG64 key;
+    while ((key = entry->key) == ADMISSION_CLAIMING)
+    {
+        SwitchToThread();
+    }
+    return key;
+}
+
+// returns TRUE if entry still belongs to key once held. A reuse claims the key before it checks
+// holders, so either it sees this hold and gives the entry back, or this sees the new key.
+static BOOL HoldEntry(LPADMISSION_ENTRY entry, LONG64 key)
+{
+    InterlockedIncrement(&entry->holders);
+    if (LoadKey(entry) == key)
+        return TRUE;
+    InterlockedDecrement(&entry->holders);
+    return FALSE;
+}
+
+// Buckets are filled only by the lookup owning the claim, so losing lookups do not refill them.
+static LPADMISSION_ENTRY FillEntry(LPADMISSION_TABLE table, LPADMISSION_ENTRY entry, LONG64 key, ULONGLONG nowMs)
+{
+    entry->connBucket = BUCKET(nowMs, table->connBurst * 1000);
+    entry->byteBucket = BUCKET(nowMs, table->byteBurst);
+    InterlockedIncrement(&entry->holders);
+    InterlockedExchange64(&entry->key, key);
+    return entry;
+}
+
+static BOOL IsIdle(LPADMISSION_ENTRY entry, ULONGLONG nowMs)
+{
+    DWORD lastSeen = BUCKET_TIME(entry->connBucket);
+    DWORD lastBytes = BUCKET_TIME(entry->byteBucket);
+    if ((DWORD)(lastBytes - lastSeen) < MAXDWORD / 2)
+    {
+        lastSeen = lastBytes;
+    }
+    return (DWORD)((DWORD)nowMs - lastSeen) > ADMISSION_IDLE_MS && entry->holders == 0;
+}
+
+/*
+    returns NULL when address is not limited or table is full. Admission fails open in both cases.
+    Otherwise entry is held until AdmissionRelease, so it is not given to another address meanwhile.
+*/
+LPADMISSION_ENTRY AdmissionLookup(LPADMISSION_TABLE table, const SOCKADDR *addr, ULONGLONG nowMs)
+{
+    UCHAR address[16];
+    ULONGLONG high, low, key;
+    LPADMISSION_ENTRY reusable = NULL;
+
+    if (!table)
+        return NULL;
+
+    // IPv4 addresses are keyed as IPv4-mapped, the same a dual-stack listener reports.
+    switch (addr->sa_family)
+    {
+    case AF_INET:
+        ZeroMemory(address, 10);
+        address[10] = address[11] = 0xff;
+        CopyMemory(address + 12, &((const SOCKADDR_IN *)addr)->sin_addr, 4);
+        break;
+    case AF_INET6:
+        CopyMemory(address, &((const SOCKADDR_IN6 *)addr)->sin6_addr, 16);
+        break;
+    default:
+        return NULL;
+    }
+
+    // splitmix64 finalizer over both halves.
+    CopyMemory(&high, address, sizeof(high));
+    CopyMemory(&low, address + 8, sizeof(low));
+    key = high ^ (low * 0x9e3779b97f4a7c15ULL);
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    if (key == 0 || (LONG64)key == ADMISSION_CLAIMING)
+        key = 1;
+
+    for (DWORD probe = 0; probe < ADMISSION_MAX_PROBES; probe++)
+    {
+        LPADMISSION_ENTRY entry = &table->entries[(key + probe) & (ADMISSION_TABLE_SIZE - 1)];
+        LONG64 entryKey = LoadKey(entry);
+
+        if (entryKey == 0)
+        {
+            if (InterlockedCompareExchange64(&entry->key, ADMISSION_CLAIMING, 0) == 0)
+            {
+                return FillEntry(table, entry, (LONG64)key, nowMs);
+            }
+            // another lookup took it, maybe for the same address.
+            entryKey = LoadKey(entry);
+        }
+        if (entryKey == (LONG64)key)
+        {
+            if (HoldEntry(entry, (LONG64)key))
+                return entry;
+            continue;
+        }
+        if (!reusable && IsIdle(entry, nowMs))
+        {
+            reusable = entry;
+        }
+    }
+
+    // table is crowded around this key. Take over an idle entry of another address, unless it got a holder.
+    if (reusable)
+    {
+        LONG64 oldKey = LoadKey(reusable);
+        if (oldKey != 0 && oldKey != (LONG64)key &&
+            InterlockedCompareExchange64(&reusable->key, ADMISSION_CLAIMING, oldKey) == oldKey)
+        {
+            if (reusable->holders == 0)
+            {
+                return FillEntry(table, reusable, (LONG64)key, nowMs);
+            }
+            InterlockedExchange64(&reusable->key, oldKey);
+        }
+    }
+    return NULL;
+}
+
+// Connection closed, or rejected after its lookup.
+void AdmissionRelease(LPADMISSION_ENTRY entry)
+{
+    if (entry)
+    {
+        InterlockedDecrement(&entry->holders);
+    }
+}
+
+BOOL AdmissionAcquireConnection(LPADMISSION_TABLE table, LPADMISSION_ENTRY entry, ULONGLONG nowMs)
+{
+    LONG64 bucket, newBucket;
+    BOOL admitted;
+
+    if (!table || !entry || table->connRate == 0)
+        return TRUE;
+
+    do
+    {
+        bucket = entry->connBucket;
+        // rate is in connections per second, which is the same as milli-connections per ms.
+        ULONGLONG elapsed = (DWORD)((DWORD)nowMs - BUCKET_TIME(bucket));
+        ULONGLONG tokens = min(BUCKET_TOKENS(bucket) + elapsed * table->connRate, (ULONGLONG)table->connBurst * 1000);
+
+        admitted = tokens >= 1000;
+        newBucket = BUCKET(nowMs, admitted ? tokens - 1000 : tokens);
+    } while (InterlockedCompareExchange64(&entry->connBucket, newBucket, bucket) != bucket);
+
+    return admitted;
+}
+
+// consumes bytes from the bucket. Returns ms to wait before reading again from this address.
+DWORD AdmissionConsumeBytes(LPADMISSION_TABLE table, LPADMISSION_ENTRY entry, DWORD bytes, ULONGLONG nowMs)
+{
+    LONG64 bucket, newBucket;
+    LONG64 tokens;
+
+    if (!table || !entry || table->byteRate == 0)
+        return 0;
+
+    do
+    {
+        bucket = entry->byteBucket;
+        DWORD lastTime = BUCKET_TIME(bucket);
+        ULONGLONG refill = (ULONGLONG)(DWORD)((DWORD)nowMs - lastTime) * table->byteRate / 1000;
+
+        tokens = (LONG)BUCKET_TOKENS(bucket);
+        // advance refill time only when some bytes were refilled, so slow rates are not lost.
+        if (refill > 0)
+        {
+            tokens += (LONG64)refill;
+            lastTime = (DWORD)nowMs;
+        }
+        tokens = min(tokens, (LONG64)table->byteBurst) - bytes;
+        // debt is bounded so one huge read does not block an address for ever.
+        tokens = max(tokens, -(LONG64)table->byteBurst);
+        newBucket = BUCKET(lastTime, (LONG)tokens);
+    } while (InterlockedCompareExchange64(&entry->byteBucket, newBucket, bucket) != bucket);
+
+    if (tokens >= 0)
+        return 0;
+    return (DWORD)((-tokens * 1000 + table->byteRate - 1) / table->byteRate);
+}
+
+/*
+    Called by WSAAccept before the connection is accepted. Listeners with SO_CONDITIONAL_ACCEPT
+    do not complete the handshake until then, so rejected clients cost no connection data and
+    get a reset.
+*/
+int CALLBACK AcceptCondition(LPWSABUF lpCallerId, LPWSABUF lpCallerData, LPQOS lpSQOS, LPQOS lpGQOS,
+                             LPWSABUF lpCalleeId, LPWSABUF lpCalleeData, GROUP FAR *g, DWORD_PTR dwCallbackData)
+{
+    LPACCEPT_CONTEXT context = (LPACCEPT_CONTEXT)dwCallbackData;
+    LPADMISSION_TABLE admission = context->serverInfo->admission;
+
+    (void)lpCallerData, (void)lpSQOS, (void)lpGQOS, (void)lpCalleeId, (void)lpCalleeData, (void)g;
+
+    context->admission = NULL;
+    if (GetNumClients(context->serverInfo) >= MAX_CLIENTS)
+    {
+        fprintf(stderr, "Max clients exceeded\n");
+        return CF_REJECT;
+    }
+    if (admission && lpCallerId && lpCallerId->buf)
+    {
+        ULONGLONG nowMs = AdmissionNowMs(admission);
+        context->admission = AdmissionLookup(admission, (const SOCKADDR *)lpCallerId->buf, nowMs);
+        if (!AdmissionAcquireConnection(admission, context->admission, nowMs))
+        {
+            AdmissionRelease(context->admission);
+            context->admission = NULL;
+            return CF_REJECT;
+        }
+    }
+    return CF_ACCEPT;
+}
+
+// Timer queue thread only posts the read to the IOCP, so workers keep owning the client.
+VOID CALLBACK ResumeReadTimer(PVOID lpParameter, BOOLEAN timerOrWaitFired)
+{
+    LPCLIENT_INFO clientInfo = (LPCLIENT_INFO)lpParameter;
+
+    (void)timerOrWaitFired;
+    ZeroMemory(&(clientInfo->overlapped), sizeof(EOVERLAPPED));
+    clientInfo->overlapped.eventType = EVENT_RESUME_READ;
+    PostQueuedCompletionStatus(gServerInfo->completionPort, 0, (ULONG_PTR)clientInfo, (LPOVERLAPPED)&clientInfo->overlapped);
+}
+
+// parses "rate[:burst]". Burst defaults to one second of rate.
+BOOL ParseRate(const char *arg, DWORD *rate, DWORD *burst)
+{
+    char *end;
+
+    *rate = strtoul(arg, &end, 10);
+    *burst = *rate;
+    if (*end == ':')
+    {
+        *burst = strtoul(end + 1, &end, 10);
+    }
+    return *end == '\0' && *rate > 0;
+}
+
+SOCKET CreateTcpListener(INT port, char *winErrorMsgBuffer)
+{
+    SOCKADDR_STORAGE localAddr;
+    INT localAddrLen;
+    SOCKET listenSocket;
+
+    ZeroMemory(&localAddr, sizeof(SOCKADDR_STORAGE));
+
+    // Prefer a dual-stack IPv6 socket, so IPv4 clients are accepted as IPv4-mapped addresses.
+    listenSocket = WSASocketW(AF_INET6, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (listenSocket != INVALID_SOCKET)
+    {
+        DWORD v6Only = 0;
+        setsockopt(listenSocket, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&v6Only, sizeof(DWORD));
+
+        LPSOCKADDR_IN6 localAddr6 = (LPSOCKADDR_IN6)&localAddr;
+        localAddr6->sin6_family = AF_INET6;
+        localAddr6->sin6_addr = in6addr_any;
+        localAddr6->sin6_port = htons((USHORT)port);
+        localAddrLen = sizeof(SOCKADDR_IN6);
+    }
+    else
+    {
+        // IPv6 not available. Fallback to IPv4 only.
+        listenSocket = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+        if (listenSocket == INVALID_SOCKET)
+        {
+            PWError("Error creating socket port", winErrorMsgBuffer);
+            return INVALID_SOCKET;
+        }
+        LPSOCKADDR_IN localAddr4 = (LPSOCKADDR_IN)&localAddr;
+        localAddr4->sin_family = AF_INET;
+        localAddr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        localAddr4->sin_port = htons((USHORT)port);
+        localAddrLen = sizeof(SOCKADDR_IN);
+    }
+
+    // Set SO_REUSEADDR option to allow reuse of the address
+    BOOL bOptVal = TRUE;
+    int bOptLen = sizeof(BOOL);
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&bOptVal, bOptLen);
+
+    // Handshake is not completed until AcceptCondition accepts the connection.
+    setsockopt(listenSocket, SOL_SOCKET, SO_CONDITIONAL_ACCEPT, (char *)&bOptVal, bOptLen);
+
+    // data in the SYN of returning clients. Fails on older Windows versions, which is harmless.
+    DWORD fastOpen = 1;
+    setsockopt(listenSocket, IPPROTO_TCP, TCP_FASTOPEN, (char *)&fastOpen, sizeof(fastOpen));
+
+    if (bind(listenSocket, (SOCKADDR *)&localAddr, localAddrLen) == SOCKET_ERROR)
+    {
+        PWError("Error binding port", winErrorMsgBuffer);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+
+    if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        PWError("Error listening on port", winErrorMsgBuffer);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+    return listenSocket;
+}
+
+SOCKET CreateUnixListener(const char *path, char *winErrorMsgBuffer)
+{
+    SOCKADDR_UN localAddr;
+    SOCKET listenSocket;
+
+    if (strlen(path) >= UNIX_PATH_MAX)
+    {
+        fprintf(stderr, "Unix socket path too long\n");
+        return INVALID_SOCKET;
+    }
+
+    // AF_UNIX sockets are available since Windows 10 build 17063.
+    listenSocket = WSASocketW(AF_UNIX, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (listenSocket == INVALID_SOCKET)
+    {
+        PWError("Error creating unix socket", winErrorMsgBuffer);
+        return INVALID_SOCKET;
+    }
+
+    ZeroMemory(&localAddr, sizeof(SOCKADDR_UN));
+    localAddr.sun_family = AF_UNIX;
+    strncpy(localAddr.sun_path, path, UNIX_PATH_MAX - 1);
+
+    // remove socket file left by a previous run.
+    DeleteFileA(path);
+
+    if (bind(listenSocket, (SOCKADDR *)&localAddr, sizeof(SOCKADDR_UN)) == SOCKET_ERROR)
+    {
+        PWError("Error binding unix socket", winErrorMsgBuffer);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+
+    if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        PWError("Error listening on unix socket", winErrorMsgBuffer);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+    return listenSocket;
+}
+
+LPSERVER_INFO CreateServer(SOCKET *listenSockets, INT nListeners, const char *unixSocketPath)
 {
     LPSERVER_INFO server;
     server = (LPSERVER_INFO)malloc(sizeof(SERVER_INFO));
     ZeroMemory(server, sizeof(SERVER_INFO));
     server->clients = (LPCLIENT_INFO *)malloc(MAX_CLIENTS * sizeof(LPCLIENT_INFO));
     ZeroMemory(server->clients, MAX_CLIENTS * sizeof(LPCLIENT_INFO));
-    server->listenSocket = listenSocket;
+    for (INT i = 0; i < nListeners; i++)
+    {
+        server->listenFds[i].fd = listenSockets[i];
+        server->listenFds[i].events = POLLRDNORM;
+    }
+    server->nListeners = nListeners;
+    if (unixSocketPath)
+    {
+        strncpy(server->unixSocketPath, unixSocketPath, UNIX_PATH_MAX - 1);
+    }
     InitializeCriticalSection(&server->criticalSection);
     return server;
 }
@@ -149,12 +646,20 @@ void CloseServer(LPSERVER_INFO lpServerInfo)
     }
     LeaveCriticalSection(&lpServerInfo->criticalSection);
     DeleteCriticalSection(&lpServerInfo->criticalSection);
-    closesocket(lpServerInfo->listenSocket);
+    for (INT i = 0; i < lpServerInfo->nListeners; i++)
+    {
+        closesocket(lpServerInfo->listenFds[i].fd);
+    }
+    if (lpServerInfo->unixSocketPath[0])
+    {
+        DeleteFileA(lpServerInfo->unixSocketPath);
+    }
+    AdmissionFree(lpServerInfo->admission);
     free(lpServerInfo->clients);
     free(lpServerInfo);
 }
 
-LPCLIENT_INFO RegisterClient(LPSERVER_INFO pServerInfo, SOCKET clientSocket, LPSOCKADDR_IN remoteClientAddrInfo, int remoteLen)
+LPCLIENT_INFO RegisterClient(LPSERVER_INFO pServerInfo, SOCKET clientSocket, LPSOCKADDR remoteClientAddrInfo, int remoteLen, LPADMISSION_ENTRY admission)
 {
     LPCLIENT_INFO clientInfo = (LPCLIENT_INFO)malloc(sizeof(CLIENT_INFO));
     ZeroMemory(clientInfo, sizeof(CLIENT_INFO));
@@ -166,8 +671,8 @@ LPCLIENT_INFO RegisterClient(LPSERVER_INFO pServerInfo, SOCKET clientSocket, LPS
     clientInfo->socket = clientSocket;
     CopyMemory(&clientInfo->clientAddr, remoteClientAddrInfo, remoteLen);
 
-    inet_ntop(AF_INET, &remoteClientAddrInfo->sin_addr, clientInfo->addressStr, INET_ADDRSTRLEN);
-    clientInfo->port = htons(remoteClientAddrInfo->sin_port);
+    FormatSockAddr((SOCKADDR *)&clientInfo->clientAddr, clientInfo->addressStr, MAX_ADDR_STR);
+    clientInfo->admission = admission;
 
     EnterCriticalSection(&pServerInfo->criticalSection);
     for (INT c = 0; c < MAX_CLIENTS; c++)
@@ -195,9 +700,21 @@ INT GetNumClients(LPSERVER_INFO lpServerInfo)
 
 void UnregisterClient(LPSERVER_INFO lpServerInfo, LPCLIENT_INFO clientInfo)
 {
+    HANDLE resumeTimer;
+
     if (!clientInfo)
         return;
+    EnterCriticalSection(&lpServerInfo->criticalSection);
+    resumeTimer = clientInfo->resumeTimer;
+    LeaveCriticalSection(&lpServerInfo->criticalSection);
+    if (resumeTimer)
+    {
+        // waits for a running callback, so it does not post a read of a freed client.
+        DeleteTimerQueueTimer(NULL, resumeTimer, INVALID_HANDLE_VALUE);
+    }
     closesocket(clientInfo->socket);
+    // entry can be reused by another address once no connection holds it.
+    AdmissionRelease(clientInfo->admission);
     free(clientInfo->wsaBuf.buf);
     free(clientInfo);
 
@@ -245,7 +762,8 @@ DWORD WINAPI ServerWorkerThread(LPVOID pParameter)
             remains too.
 
         4 - If packet is SEND type but there is no data pending to send, queue a Read
-            to continue fetching data from client.
+            to continue fetching data from client. If client address exceeded its byte rate,
+            a timer posts a RESUME_READ packet later, which queues the Read instead.
     */
 
     while (!finish)
@@ -256,14 +774,25 @@ DWORD WINAPI ServerWorkerThread(LPVOID pParameter)
                                       (LPOVERLAPPED *)&overlappedResult,
                                       INFINITE))
         {
-            if (bytesTransferred == 0)
+            LPEOVERLAPPED lpClientOverlapped = (LPEOVERLAPPED)overlappedResult;
+
+            if (lpClientOverlapped->eventType == EVENT_RESUME_READ)
+            {
+                // expired timer is deleted on next arm or unregister: the worker which armed it may still be publishing it.
+                clientInfo->readDelayMs = 0;
+            }
+            else if (bytesTransferred == 0)
             {
-                printf(LOG_FORMAT("Client close connection"), clientInfo->addressStr, clientInfo->port);
+                printf(LOG_FORMAT("Client close connection"), clientInfo->addressStr);
                 UnregisterClient(serverInfo, clientInfo);
                 continue;
             }
 
-            LPEOVERLAPPED lpClientOverlapped = (LPEOVERLAPPED)overlappedResult;
+            if (lpClientOverlapped->eventType == EVENT_READ && clientInfo->admission)
+            {
+                LPADMISSION_TABLE admission = serverInfo->admission;
+                clientInfo->readDelayMs = AdmissionConsumeBytes(admission, clientInfo->admission, bytesTransferred, AdmissionNowMs(admission));
+            }
 
             if (lpClientOverlapped->eventType == EVENT_READ ||
                 (lpClientOverlapped->eventType == EVENT_SEND && bytesTransferred < lpClientOverlapped->bytesSent))
@@ -277,7 +806,34 @@ DWORD WINAPI ServerWorkerThread(LPVOID pParameter)
 
                 if (OverlappedOperationError(ovlpOpResult, &wsaError))
                 {
-                    printf(LOG_FORMAT("Error sending data: %s. Closing connection"), clientInfo->addressStr, clientInfo->port, StrWinError(wsaError, winErrorMsgBuf));
+                    printf(LOG_FORMAT("Error sending data: %s. Closing connection"), clientInfo->addressStr, StrWinError(wsaError, winErrorMsgBuf));
+                    UnregisterClient(serverInfo, clientInfo);
+                }
+            }
+            else if (clientInfo->readDelayMs)
+            {
+                // byte rate exceeded. All data was echoed, delay the next read. Timer is created and published
+                // under the critical section: it may fire and be handled by another worker before Create returns.
+                HANDLE resumeTimer;
+                BOOL created;
+
+                EnterCriticalSection(&serverInfo->criticalSection);
+                if (clientInfo->resumeTimer)
+                {
+                    // previous timer already fired: its RESUME_READ led to this arm.
+                    DeleteTimerQueueTimer(NULL, clientInfo->resumeTimer, NULL);
+                    clientInfo->resumeTimer = NULL;
+                }
+                created = CreateTimerQueueTimer(&resumeTimer, NULL, ResumeReadTimer, clientInfo,
+                                                clientInfo->readDelayMs, 0, WT_EXECUTEONLYONCE);
+                if (created)
+                {
+                    clientInfo->resumeTimer = resumeTimer;
+                }
+                LeaveCriticalSection(&serverInfo->criticalSection);
+                if (!created)
+                {
+                    PWError("Error creating resume timer", winErrorMsgBuf);
                     UnregisterClient(serverInfo, clientInfo);
                 }
             }
@@ -294,7 +850,7 @@ DWORD WINAPI ServerWorkerThread(LPVOID pParameter)
 
                 if (OverlappedOperationError(opOvlResult, &wsaError))
                 {
-                    printf(LOG_FORMAT("Error fetching data: %s. Closing connection"), clientInfo->addressStr, clientInfo->port, StrWinError(wsaError, winErrorMsgBuf));
+                    printf(LOG_FORMAT("Error fetching data: %s. Closing connection"), clientInfo->addressStr, StrWinError(wsaError, winErrorMsgBuf));
                     UnregisterClient(serverInfo, clientInfo);
                 }
             }
@@ -323,6 +879,60 @@ DWORD WINAPI ServerWorkerThread(LPVOID pParameter)
     return 0;
 }
 
+// Accepts a connection from a listener and starts echoing it.
+void AcceptClient(LPSERVER_INFO serverInfo, SOCKET listenSocket, char *winErrorMsgBuffer)
+{
+    SOCKADDR_STORAGE saRemote;
+    SOCKET acceptSocket;
+    int remoteLen = sizeof(saRemote);
+    ACCEPT_CONTEXT acceptContext;
+
+    ZeroMemory(&saRemote, sizeof(SOCKADDR_STORAGE));
+    acceptContext.serverInfo = serverInfo;
+    acceptContext.admission = NULL;
+    acceptSocket = WSAAccept(listenSocket, (SOCKADDR *)&saRemote, &remoteLen, AcceptCondition, (DWORD_PTR)&acceptContext);
+
+    if (acceptSocket == INVALID_SOCKET)
+    {
+        // NULL if rejected by AcceptCondition, which releases it.
+        AdmissionRelease(acceptContext.admission);
+        // rejected by AcceptCondition.
+        if (WSAGetLastError() == WSAECONNREFUSED)
+            return;
+        SetLastError(WSAGetLastError());
+        PWError("Error accepting a connection attempt", winErrorMsgBuffer);
+        return;
+    }
+
+    LPCLIENT_INFO clientInfo = RegisterClient(serverInfo, acceptSocket, (SOCKADDR *)&saRemote, remoteLen, acceptContext.admission);
+
+    printf(LOG_FORMAT("Connected"), clientInfo->addressStr);
+
+    // assign IOCP to socket to receive I/O events.
+    if (CreateIoCompletionPort((HANDLE)acceptSocket, serverInfo->completionPort, (ULONG_PTR)clientInfo, 0) == NULL)
+    {
+        PWError("Error when assigning socket to IOCP", winErrorMsgBuffer);
+        UnregisterClient(serverInfo, clientInfo);
+        return;
+    }
+
+    DWORD wsaRecvFlags = 0;
+    DWORD ovlpOpResult;
+    DWORD wsaErrorCode;
+
+    // begin reading so Workers can process the completion reads.
+    clientInfo->overlapped.eventType = EVENT_READ;
+    ovlpOpResult = WSARecv(clientInfo->socket, &(clientInfo->wsaBuf), 1, NULL,
+                           (LPDWORD)&wsaRecvFlags, (LPOVERLAPPED)&clientInfo->overlapped, NULL);
+    if (OverlappedOperationError(ovlpOpResult, &wsaErrorCode))
+    {
+        // if starting reading fails, close connection client directly.
+        printf(LOG_FORMAT("Error starting receiving data: %s"),
+               clientInfo->addressStr, StrWinError(wsaErrorCode, winErrorMsgBuffer));
+        UnregisterClient(serverInfo, clientInfo);
+    }
+}
+
 INT CreateWorkerThreads(LPSERVER_INFO lpServerInfo)
 {
 
@@ -377,9 +987,12 @@ int main(int argc, char *argv[])
 {
 
     WSADATA wsaData;
-    SOCKADDR_IN internetAddr;
     INT serverPort;
-    SOCKET listenSocket;
+    INT argIndex;
+    DWORD connRate, connBurst, byteRate, byteBurst;
+    const char *unixSocketPath;
+    SOCKET listenSockets[MAX_LISTENERS];
+    INT nListeners;
     INT wsaOpResult;
     HANDLE completionPort;
 
@@ -388,13 +1001,36 @@ int main(int argc, char *argv[])
     CHAR winErrorMsgBuf[MAX_BUF_WIN_STR_ERROR];
     LPSERVER_INFO serverInfo;
 
-    if (argc < 2)
+    connRate = connBurst = byteRate = byteBurst = 0;
+    for (argIndex = 1; argIndex + 1 < argc && argv[argIndex][0] == '-'; argIndex += 2)
+    {
+        BOOL validRate;
+        if (strcmp(argv[argIndex], "-c") == 0)
+        {
+            validRate = ParseRate(argv[argIndex + 1], &connRate, &connBurst);
+        }
+        else if (strcmp(argv[argIndex], "-b") == 0)
+        {
+            validRate = ParseRate(argv[argIndex + 1], &byteRate, &byteBurst);
+        }
+        else
+        {
+            validRate = FALSE;
+        }
+        if (!validRate)
+        {
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argIndex >= argc)
     {
         Usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    serverPort = atoi(argv[1]);
+    serverPort = atoi(argv[argIndex]);
 
     if (serverPort <= 0)
     {
@@ -402,6 +1038,8 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    unixSocketPath = argc > argIndex + 1 ? argv[argIndex + 1] : NULL;
+
     SetConsoleCtrlHandler(CtrlHandler, TRUE);
 
     wsaOpResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -412,36 +1050,25 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    listenSocket = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
-
-    if (listenSocket == INVALID_SOCKET)
+    nListeners = 0;
+    listenSockets[nListeners] = CreateTcpListener(serverPort, winErrorMsgBuf);
+    if (listenSockets[nListeners] == INVALID_SOCKET)
     {
-        PWError("Error creating socket port", winErrorMsgBuf);
         WSACleanup();
         return EXIT_FAILURE;
     }
-    
-    internetAddr.sin_family = AF_INET;
-    internetAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    internetAddr.sin_port = htons((USHORT)serverPort);
-
-    // Set SO_REUSEADDR option to allow reuse of the address
-    BOOL bOptVal = TRUE;
-    int bOptLen = sizeof(BOOL);
-    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&bOptVal, bOptLen);
-
-    wsaOpResult = bind(listenSocket, (SOCKADDR *)&internetAddr, sizeof(SOCKADDR));
-    if (wsaOpResult == SOCKET_ERROR)
-    {
-        PWError("Error binding port", winErrorMsgBuf);
-        return EXIT_FAILURE;
-    }
+    nListeners++;
 
-    wsaOpResult = listen(listenSocket, SOMAXCONN);
-    if (wsaOpResult == SOCKET_ERROR)
+    if (unixSocketPath)
     {
-        PWError("Error listening on port", winErrorMsgBuf);
-        return EXIT_FAILURE;
+        listenSockets[nListeners] = CreateUnixListener(unixSocketPath, winErrorMsgBuf);
+        if (listenSockets[nListeners] == INVALID_SOCKET)
+        {
+            closesocket(listenSockets[0]);
+            WSACleanup();
+            return EXIT_FAILURE;
+        }
+        nListeners++;
     }
 
     // The famous IOCP
@@ -449,14 +1076,29 @@ int main(int argc, char *argv[])
     if (completionPort == NULL)
     {
         PWError("Error creating IOCP", winErrorMsgBuf);
-        closesocket(listenSocket);
+        for (INT i = 0; i < nListeners; i++)
+        {
+            closesocket(listenSockets[i]);
+        }
         WSACleanup();
         return EXIT_FAILURE;
     }
 
-    gServerInfo = serverInfo = CreateServer(listenSocket);
+    gServerInfo = serverInfo = CreateServer(listenSockets, nListeners, unixSocketPath);
     serverInfo->completionPort = completionPort;
-    serverInfo->listenSocket = listenSocket;
+
+    if (connRate || byteRate)
+    {
+        serverInfo->admission = AdmissionCreate(connRate, connBurst, byteRate, byteBurst);
+        if (!serverInfo->admission)
+        {
+            fprintf(stderr, "Error creating admission table\n");
+            Cleanup();
+            return EXIT_FAILURE;
+        }
+        printf("Admission per client address: %lu connections/s (burst %lu), %lu bytes/s (burst %lu)\n",
+               connRate, connBurst, byteRate, byteBurst);
+    }
 
     workersCreated = CreateWorkerThreads(serverInfo);
 
@@ -469,55 +1111,28 @@ int main(int argc, char *argv[])
     }
 
     printf("Server listening on port %d. Workers: %d\n", serverPort, workersCreated);
+    if (unixSocketPath)
+    {
+        printf("Server listening on unix socket %s\n", unixSocketPath);
+    }
 
-    // Loop for accepting connections.
+    // Loop for accepting connections. Listeners are polled so all of them are served by this loop.
     while (TRUE)
     {
-        SOCKADDR_IN saRemote;
-        SOCKET acceptSocket;
-        int remoteLen = sizeof(saRemote);
-
-        acceptSocket = WSAAccept(listenSocket, (SOCKADDR *)&saRemote, &remoteLen, NULL, (DWORD_PTR)NULL);
-
-        if (acceptSocket == INVALID_SOCKET)
+        if (WSAPoll(serverInfo->listenFds, serverInfo->nListeners, -1) == SOCKET_ERROR)
         {
-            PWError("Error accepting a connection attempt", winErrorMsgBuf);
+            SetLastError(WSAGetLastError());
+            PWError("Error polling listeners", winErrorMsgBuf);
             continue;
         }
 
-        if (GetNumClients(serverInfo) >= MAX_CLIENTS)
+        // one connection from each ready listener per pass, so a busy TCP backlog does not starve the unix socket.
+        for (INT listenerIndex = 0; listenerIndex < serverInfo->nListeners; listenerIndex++)
         {
-            fprintf(stderr, "Max clients exceeded\n");
-            closesocket(acceptSocket);
-            continue;
-        }
-
-        LPCLIENT_INFO clientInfo = RegisterClient(serverInfo, acceptSocket, &saRemote, remoteLen);
-
-        printf(LOG_FORMAT("Connected"), clientInfo->addressStr, clientInfo->port);
-
-        // assign IOCP to socket to receive I/O events.
-        if (CreateIoCompletionPort((HANDLE)acceptSocket, completionPort, (ULONG_PTR)clientInfo, 0) == NULL)
-        {
-            PWError("Error when assigning socket to IOCP", winErrorMsgBuf);
-            UnregisterClient(serverInfo, clientInfo);
-            continue;
-        }
-
-        // begin reading so Workers can process the completion reads.
-        DWORD wsaRecvFlags = 0;
-        DWORD ovlpOpResult;
-        DWORD wsaErrorCode;
-
-        clientInfo->overlapped.eventType = EVENT_READ;
-        ovlpOpResult = WSARecv(clientInfo->socket, &(clientInfo->wsaBuf), 1, NULL,
-                               (LPDWORD)&wsaRecvFlags, (LPOVERLAPPED)&clientInfo->overlapped, NULL);
-        if (OverlappedOperationError(ovlpOpResult, &wsaErrorCode))
-        {
-            // if starting reading fails, close connection client directly.
-            printf(LOG_FORMAT("Error starting receiving data: %s"),
-                   clientInfo->addressStr, clientInfo->port, StrWinError(wsaErrorCode, winErrorMsgBuf));
-            UnregisterClient(serverInfo, clientInfo);
+            if (serverInfo->listenFds[listenerIndex].revents & POLLRDNORM)
+            {
+                AcceptClient(serverInfo, serverInfo->listenFds[listenerIndex].fd, winErrorMsgBuf);
+            }
         }
     }
 
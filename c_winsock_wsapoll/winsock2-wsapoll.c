@@ -3,6 +3,13 @@
 
     This is a simple echo server using Winsock2 API and WSAPoll with a single thread.
 
+    Each wakeup a connection echoes at most a budget of bytes and syscalls. Connections that
+    still have data go to a ready list, served in turn order before the next poll pass, so a
+    few bulk clients can not delay small interactive ones.
+
+    Listener enables TCP Fast Open, and a new connection echoes what arrived with the handshake
+    right after accept, without waiting for the next poll pass.
+
     author: Alejandro Ambroa (jandroz@gmail.com)
 
     To compile (using Visual Studio command prompt):
@@ -15,15 +22,25 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <ws2tcpip.h>
 #include <mswsock.h>
+#include <afunix.h>
 
-#define PROGRAM_VERSION "v1.0.0"
+#define PROGRAM_VERSION "v1.2.0"
 #define MAX_BUF_WIN_STR_ERROR 64
 #define DATA_BUFSIZE 2048
 #define CONNECTION_REALLOC_SIZE 10
 #define POLLCLOSE (POLLERR | POLLHUP | POLLNVAL)
-#define START_CLIENT_CONNETIONS 2
+#define MAX_LISTENERS 2
+#define MAX_ADDR_STR (INET6_ADDRSTRLEN + 8 > UNIX_PATH_MAX + 5 ? INET6_ADDRSTRLEN + 8 : UNIX_PATH_MAX + 5)
+// per connection and wakeup. A receive and its echo are 2 syscalls.
+#define DEFAULT_BYTES_BUDGET (16 * DATA_BUFSIZE)
+#define DEFAULT_SYSCALLS_BUDGET 16
+#define MIN_SYSCALLS_BUDGET 2
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 15 // ws2ipdef.h, Windows 10 1607 and later.
+#endif
 
 //#pragma comment(lib, "ws2_32")
 //#pragma comment(lib, "Mswsock")
@@ -42,37 +59,71 @@ typedef enum
     RETRY
 } SENDING_STATE;
 
+typedef enum
+{
+    SERVE_DONE,  // nothing left to read, or waiting to send.
+    SERVE_MORE,  // budget spent with data left to read.
+    SERVE_CLOSED // closed by peer or failed. Connection must be unregistered.
+} SERVE_RESULT;
+
 typedef struct
 {
-    WSABUF wsaBuf;
+    CHAR *buffer;
+    WSABUF wsaBuf; // what remains to send, inside buffer.
     OVERLAPPED overlapped;
-    LPSOCKADDR_IN clientAddr;
+    LPSOCKADDR_STORAGE clientAddr;
     DWORD bytesSent;
     DWORD bytesReceived;
     CONNECTION_TYPE type;
     SENDING_STATE sendingState;
+    int readySlot;        // position in the ready list, -1 if not in it.
+    ULONGLONG readySince; // microseconds. When it was left with data to read.
 } CONNECTION, *LPCONNECTION;
 
+typedef struct
+{
+    ULONGLONG deferred; // times a connection spent its budget with data left.
+    ULONGLONG resumed;
+    ULONGLONG starvationUs; // time from deferral to next turn.
+    ULONGLONG maxStarvationUs;
+} FAIRNESS_STATS;
+
 typedef struct
 {
     LPWSAPOLLFD pollFds;
     LPCONNECTION connectionsData;
     int nConnections;
     int capacity;
+    int firstClient; // control socket and listeners are at the beginning of the arrays.
+    // connections indexes in turn order. Closed ones are -1 until next pass.
+    int *ready;
+    int nReady;
+    DWORD bytesBudget;
+    DWORD syscallsBudget;
+    DWORD pass; // rotates first client visited by the poll pass.
+    FAIRNESS_STATS stats;
 } SERVER, *LPSERVER;
 
 char *StrWinError(DWORD errorCode, char *winErrorMsgBuffer);
 void PWError(const char *mainMsg, char *winErrorMsgBuffer);
+char *FormatSockAddr(const SOCKADDR *addr, char *addrStrBuffer, size_t bufferLen);
 void ServerLog(LPCONNECTION lpConnection, const char *msg, ...);
 void Usage(const char *programName);
-LPSERVER CreateServer(SOCKET listenerSocket);
+ULONGLONG NowUs(void);
+SOCKET CreateTcpListener(INT port, char *winErrorMsgBuffer);
+SOCKET CreateUnixListener(const char *path, char *winErrorMsgBuffer);
+LPSERVER CreateServer(SOCKET *listenSockets, int nListeners, DWORD bytesBudget, DWORD syscallsBudget);
 LPCONNECTION RegisterConnection(
     LPSERVER server,
     SOCKET listenerSocket,
-    LPSOCKADDR_IN clientAddr,
+    LPSOCKADDR_STORAGE clientAddr,
     CONNECTION_TYPE type);
 void UnregisterConnection(LPSERVER lpServer, int index);
 void RebuildServerConnectionsFds(LPSERVER lpServer);
+SERVE_RESULT EchoWithBudget(LPSERVER lpServer, int index, char *winErrorMsgBuffer);
+void PushReady(LPSERVER lpServer, int index);
+void ServeReadyList(LPSERVER lpServer, BOOL *rebuild, char *winErrorMsgBuffer);
+void PrintFairnessStats(LPSERVER lpServer);
 void RequestCloseServer(LPSERVER lpServer);
 void CloseServer(LPSERVER lpServer);
 BOOL WINAPI CtrlHandler(DWORD fdwCtrlType);
@@ -93,15 +144,38 @@ char *StrWinError(DWORD errorCode, char *winErrorMsgBuffer)
     return winErrorMsgBuffer;
 }
 
+char *FormatSockAddr(const SOCKADDR *addr, char *addrStrBuffer, size_t bufferLen)
+{
+    char ipStr[INET6_ADDRSTRLEN] = {0};
+
+    switch (addr->sa_family)
+    {
+    case AF_INET:
+        inet_ntop(AF_INET, &((const SOCKADDR_IN *)addr)->sin_addr, ipStr, INET6_ADDRSTRLEN);
+        snprintf(addrStrBuffer, bufferLen, "%s:%d", ipStr, ntohs(((const SOCKADDR_IN *)addr)->sin_port));
+        break;
+    case AF_INET6:
+        inet_ntop(AF_INET6, &((const SOCKADDR_IN6 *)addr)->sin6_addr, ipStr, INET6_ADDRSTRLEN);
+        snprintf(addrStrBuffer, bufferLen, "[%s]:%d", ipStr, ntohs(((const SOCKADDR_IN6 *)addr)->sin6_port));
+        break;
+    case AF_UNIX:
+        // clients connected to an AF_UNIX socket are usually unnamed.
+        snprintf(addrStrBuffer, bufferLen, "unix:%.*s", UNIX_PATH_MAX, ((const SOCKADDR_UN *)addr)->sun_path);
+        break;
+    default:
+        snprintf(addrStrBuffer, bufferLen, "unknown family %d", addr->sa_family);
+    }
+    return addrStrBuffer;
+}
+
 void ServerLog(LPCONNECTION lpConnection, const char *msg, ...)
 {
-    char addrStr[INET_ADDRSTRLEN] = {0};
-    inet_ntop(AF_INET, &lpConnection->clientAddr->sin_addr, addrStr, INET_ADDRSTRLEN);
-    USHORT port = ntohs(lpConnection->clientAddr->sin_port);
+    char addrStr[MAX_ADDR_STR] = {0};
+    FormatSockAddr((SOCKADDR *)lpConnection->clientAddr, addrStr, MAX_ADDR_STR);
 
     va_list args;
     va_start(args, msg);
-    printf("%s:%d -> ", addrStr, port);
+    printf("%s -> ", addrStr);
     vprintf(msg, args);
     printf("\n");
     va_end(args);
@@ -115,21 +189,148 @@ void PWError(const char *mainMsg, char *winErrorMsgBuffer)
 
 void Usage(const char *programName)
 {
-    printf("Usage: %s <port>\n", programName);
+    printf("Usage: %s [-B bytes] [-S syscalls] <port> [unix socket path]\n"
+           "  -B bytes     max bytes echoed by a connection per wakeup (default %d)\n"
+           "  -S syscalls  max receive and send calls of a connection per wakeup (default %d, min %d)\n",
+           programName, DEFAULT_BYTES_BUDGET, DEFAULT_SYSCALLS_BUDGET, MIN_SYSCALLS_BUDGET);
 }
 
-LPSERVER CreateServer(SOCKET listenSocket)
+ULONGLONG NowUs(void)
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (ULONGLONG)(counter.QuadPart / frequency.QuadPart * 1000000 +
+                       counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
+
+SOCKET CreateTcpListener(INT port, char *winErrorMsgBuffer)
+{
+    SOCKADDR_STORAGE localAddr;
+    INT localAddrLen;
+    SOCKET listenSocket;
+
+    ZeroMemory(&localAddr, sizeof(SOCKADDR_STORAGE));
+
+    // Prefer a dual-stack IPv6 socket, so IPv4 clients are accepted as IPv4-mapped addresses.
+    listenSocket = WSASocketW(AF_INET6, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (listenSocket != INVALID_SOCKET)
+    {
+        DWORD v6Only = 0;
+        setsockopt(listenSocket, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&v6Only, sizeof(DWORD));
+
+        LPSOCKADDR_IN6 localAddr6 = (LPSOCKADDR_IN6)&localAddr;
+        localAddr6->sin6_family = AF_INET6;
+        localAddr6->sin6_addr = in6addr_any;
+        localAddr6->sin6_port = htons((USHORT)port);
+        localAddrLen = sizeof(SOCKADDR_IN6);
+    }
+    else
+    {
+        // IPv6 not available. Fallback to IPv4 only.
+        listenSocket = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+        if (listenSocket == INVALID_SOCKET)
+        {
+            PWError("Error creating server socket", winErrorMsgBuffer);
+            return INVALID_SOCKET;
+        }
+        LPSOCKADDR_IN localAddr4 = (LPSOCKADDR_IN)&localAddr;
+        localAddr4->sin_family = AF_INET;
+        localAddr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        localAddr4->sin_port = htons((USHORT)port);
+        localAddrLen = sizeof(SOCKADDR_IN);
+    }
+
+    // Set SO_REUSEADDR option to allow reuse of the address
+    BOOL bOptVal = TRUE;
+    int bOptLen = sizeof(BOOL);
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&bOptVal, bOptLen);
+
+    // data in the SYN of returning clients. Fails on older Windows versions, which is harmless.
+    DWORD fastOpen = 1;
+    setsockopt(listenSocket, IPPROTO_TCP, TCP_FASTOPEN, (char *)&fastOpen, sizeof(fastOpen));
+
+    if (bind(listenSocket, (SOCKADDR *)&localAddr, localAddrLen) == SOCKET_ERROR)
+    {
+        PWError("Error binding server socket", winErrorMsgBuffer);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+
+    if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        PWError("Error listening on server socket", winErrorMsgBuffer);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+    return listenSocket;
+}
+
+SOCKET CreateUnixListener(const char *path, char *winErrorMsgBuffer)
+{
+    SOCKADDR_UN localAddr;
+    SOCKET listenSocket;
+
+    if (strlen(path) >= UNIX_PATH_MAX)
+    {
+        fprintf(stderr, "Unix socket path too long\n");
+        return INVALID_SOCKET;
+    }
+
+    // AF_UNIX sockets are available since Windows 10 build 17063.
+    listenSocket = WSASocketW(AF_UNIX, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (listenSocket == INVALID_SOCKET)
+    {
+        PWError("Error creating unix socket", winErrorMsgBuffer);
+        return INVALID_SOCKET;
+    }
+
+    ZeroMemory(&localAddr, sizeof(SOCKADDR_UN));
+    localAddr.sun_family = AF_UNIX;
+    strncpy(localAddr.sun_path, path, UNIX_PATH_MAX - 1);
+
+    // remove socket file left by a previous run.
+    DeleteFileA(path);
+
+    if (bind(listenSocket, (SOCKADDR *)&localAddr, sizeof(SOCKADDR_UN)) == SOCKET_ERROR)
+    {
+        PWError("Error binding unix socket", winErrorMsgBuffer);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+
+    if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        PWError("Error listening on unix socket", winErrorMsgBuffer);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+    return listenSocket;
+}
+
+LPSERVER CreateServer(SOCKET *listenSockets, int nListeners, DWORD bytesBudget, DWORD syscallsBudget)
 {
     LPSERVER lpServer = (LPSERVER)malloc(sizeof(SERVER));
     ZeroMemory(lpServer, sizeof(SERVER));
-    RegisterConnection(lpServer, listenSocket, NULL, SERVER_TYPE);
+    lpServer->bytesBudget = bytesBudget;
+    lpServer->syscallsBudget = syscallsBudget;
     // Register a control socket to stopping WSAPoll when needed.
     SOCKET controlSock = WSASocketW(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
     RegisterConnection(lpServer, controlSock, NULL, CONTROL_TYPE);
+    for (int i = 0; i < nListeners; i++)
+    {
+        RegisterConnection(lpServer, listenSockets[i], NULL, SERVER_TYPE);
+    }
+    lpServer->firstClient = lpServer->nConnections;
     return lpServer;
 }
 
-LPCONNECTION RegisterConnection(LPSERVER lpServer, SOCKET socket, LPSOCKADDR_IN clientAddr, CONNECTION_TYPE type)
+LPCONNECTION RegisterConnection(LPSERVER lpServer, SOCKET socket, LPSOCKADDR_STORAGE clientAddr, CONNECTION_TYPE type)
 {
     if (lpServer->capacity < lpServer->nConnections + 1)
     {
@@ -137,6 +338,7 @@ LPCONNECTION RegisterConnection(LPSERVER lpServer, SOCKET socket, LPSOCKADDR_IN
 
         lpServer->pollFds = (LPWSAPOLLFD)realloc((LPWSAPOLLFD)lpServer->pollFds, sizeof(WSAPOLLFD) * new_capacity);
         lpServer->connectionsData = (LPCONNECTION)realloc((LPCONNECTION)lpServer->connectionsData, sizeof(CONNECTION) * new_capacity);
+        lpServer->ready = (int *)realloc(lpServer->ready, sizeof(int) * new_capacity);
 
         lpServer->capacity = new_capacity;
     }
@@ -150,14 +352,16 @@ LPCONNECTION RegisterConnection(LPSERVER lpServer, SOCKET socket, LPSOCKADDR_IN
     pfd->events = POLLRDNORM;
     pfd->revents = 0;
 
-    pConn->wsaBuf.buf = (CHAR *)malloc(DATA_BUFSIZE);
+    pConn->buffer = (CHAR *)malloc(DATA_BUFSIZE);
+    pConn->wsaBuf.buf = pConn->buffer;
     pConn->wsaBuf.len = DATA_BUFSIZE;
+    pConn->readySlot = -1;
     pConn->bytesReceived = 0;
     pConn->bytesSent = 0;
     if (clientAddr)
     {
-        pConn->clientAddr = (LPSOCKADDR_IN)malloc(sizeof(SOCKADDR_IN));
-        CopyMemory(pConn->clientAddr, clientAddr, sizeof(SOCKADDR_IN));
+        pConn->clientAddr = (LPSOCKADDR_STORAGE)malloc(sizeof(SOCKADDR_STORAGE));
+        CopyMemory(pConn->clientAddr, clientAddr, sizeof(SOCKADDR_STORAGE));
     }
     pConn->type = type;
     return pConn;
@@ -171,7 +375,11 @@ void UnregisterConnection(LPSERVER lpServer, int index)
     LPCONNECTION pConn = &lpServer->connectionsData[index];
     closesocket(lpServer->pollFds[index].fd);
     lpServer->pollFds[index].fd = INVALID_SOCKET;
-    free(pConn->wsaBuf.buf);
+    if (pConn->readySlot >= 0)
+    {
+        lpServer->ready[pConn->readySlot] = -1;
+    }
+    free(pConn->buffer);
     if (pConn->clientAddr)
     {
         free(pConn->clientAddr);
@@ -181,8 +389,8 @@ void UnregisterConnection(LPSERVER lpServer, int index)
 
 void RebuildServerConnectionsFds(LPSERVER lpServer)
 {
-    int j = START_CLIENT_CONNETIONS; // skip listener socket and wsapoll control socket, both in beginning of array.
-    for (int i = START_CLIENT_CONNETIONS; i < lpServer->nConnections; i++)
+    int j = lpServer->firstClient; // skip wsapoll control socket and listener sockets, all in beginning of array.
+    for (int i = lpServer->firstClient; i < lpServer->nConnections; i++)
     {
         if (lpServer->pollFds[i].fd != INVALID_SOCKET)
         {
@@ -191,6 +399,10 @@ void RebuildServerConnectionsFds(LPSERVER lpServer)
                 lpServer->pollFds[j] = lpServer->pollFds[i];
                 lpServer->connectionsData[j] = lpServer->connectionsData[i];
                 lpServer->pollFds[i].fd = INVALID_SOCKET;
+                if (lpServer->connectionsData[j].readySlot >= 0)
+                {
+                    lpServer->ready[lpServer->connectionsData[j].readySlot] = j;
+                }
             }
             j++;
         }
@@ -210,12 +422,133 @@ void CloseServer(LPSERVER lpServer)
 
     free(lpServer->pollFds);
     free(lpServer->connectionsData);
+    free(lpServer->ready);
     free(lpServer);
 }
 
+// Receives and echoes until the socket is drained, a send is partial or the budget is spent.
+SERVE_RESULT EchoWithBudget(LPSERVER lpServer, int index, char *winErrorMsgBuffer)
+{
+    LPWSAPOLLFD pollFd = &lpServer->pollFds[index];
+    LPCONNECTION connData = &lpServer->connectionsData[index];
+    DWORD bytes = 0;
+    DWORD syscalls = 0;
+
+    while (TRUE)
+    {
+        int received = recv(pollFd->fd, connData->buffer, DATA_BUFSIZE, 0);
+        syscalls++;
+        if (received == SOCKET_ERROR)
+        {
+            DWORD wsaLastError = WSAGetLastError();
+            if (wsaLastError == WSAEWOULDBLOCK)
+                return SERVE_DONE;
+            ServerLog(connData, "Error fetching data: %s", StrWinError(wsaLastError, winErrorMsgBuffer));
+            return SERVE_CLOSED;
+        }
+        if (received == 0)
+        {
+            ServerLog(connData, "Closing connection.");
+            return SERVE_CLOSED;
+        }
+
+        int sent = send(pollFd->fd, connData->buffer, received, 0);
+        syscalls++;
+        if (sent == SOCKET_ERROR)
+        {
+            DWORD wsaLastError = WSAGetLastError();
+            if (wsaLastError != WSAEWOULDBLOCK)
+            {
+                ServerLog(connData, "Error sending data: %s", StrWinError(wsaLastError, winErrorMsgBuffer));
+                return SERVE_CLOSED;
+            }
+            sent = 0;
+        }
+        bytes += received;
+
+        if (sent < received)
+        {
+            // socket send buffer is full. What remains is sent when connection is writable.
+            connData->wsaBuf.buf = connData->buffer;
+            connData->wsaBuf.len = received;
+            connData->bytesReceived = received;
+            connData->bytesSent = sent;
+            connData->sendingState = INIT_SEND;
+            pollFd->events = POLLWRNORM;
+            return SERVE_DONE;
+        }
+        if (received < DATA_BUFSIZE)
+            return SERVE_DONE;
+        if (bytes >= lpServer->bytesBudget || syscalls + 2 > lpServer->syscallsBudget)
+            return SERVE_MORE;
+    }
+}
+
+void PushReady(LPSERVER lpServer, int index)
+{
+    LPCONNECTION connData = &lpServer->connectionsData[index];
+
+    connData->readySlot = lpServer->nReady;
+    connData->readySince = NowUs();
+    lpServer->ready[lpServer->nReady++] = index;
+    lpServer->stats.deferred++;
+}
+
+// Gives a turn to connections deferred by previous passes, oldest first. Those deferred again keep their order.
+void ServeReadyList(LPSERVER lpServer, BOOL *rebuild, char *winErrorMsgBuffer)
+{
+    int nReady = lpServer->nReady;
+
+    lpServer->nReady = 0;
+    for (int k = 0; k < nReady; k++)
+    {
+        int index = lpServer->ready[k];
+        if (index < 0)
+            continue;
+
+        LPCONNECTION connData = &lpServer->connectionsData[index];
+        ULONGLONG starvation = NowUs() - connData->readySince;
+        lpServer->stats.resumed++;
+        lpServer->stats.starvationUs += starvation;
+        if (starvation > lpServer->stats.maxStarvationUs)
+        {
+            lpServer->stats.maxStarvationUs = starvation;
+        }
+
+        // budget of this wakeup is spent here, so the poll pass does not read it again.
+        lpServer->pollFds[index].revents &= ~POLLRDNORM;
+        connData->readySlot = -1;
+
+        // slots below k are free: entries are only moved towards the head.
+        switch (EchoWithBudget(lpServer, index, winErrorMsgBuffer))
+        {
+        case SERVE_MORE:
+            PushReady(lpServer, index);
+            break;
+        case SERVE_CLOSED:
+            UnregisterConnection(lpServer, index);
+            *rebuild = TRUE;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void PrintFairnessStats(LPSERVER lpServer)
+{
+    FAIRNESS_STATS *stats = &lpServer->stats;
+
+    printf("Budget per connection and wakeup: %lu bytes, %lu syscalls\n", lpServer->bytesBudget, lpServer->syscallsBudget);
+    printf("Deferred turns: %llu. Starvation: avg %llu us, max %llu us\n",
+           stats->deferred,
+           stats->resumed ? stats->starvationUs / stats->resumed : 0,
+           stats->maxStarvationUs);
+}
+
 void RequestCloseServer(LPSERVER lpServer)
 {
-    closesocket(lpServer->pollFds[1].fd);
+    closesocket(lpServer->pollFds[0].fd);
 }
 
 BOOL WINAPI CtrlHandler(DWORD fdwCtrlType)
@@ -234,11 +567,14 @@ BOOL WINAPI CtrlHandler(DWORD fdwCtrlType)
 int main(int argc, char *argv[])
 {
     WSADATA wsaData;
-    SOCKADDR_IN localAddr;
     INT port;
-    SOCKET listenSocket;
+    INT argIndex;
+    DWORD bytesBudget, syscallsBudget;
+    const char *unixSocketPath;
+    SOCKET listenSockets[MAX_LISTENERS];
+    INT nListeners;
     INT wsaOpResult;
-    SOCKADDR_IN remoteAddr;
+    SOCKADDR_STORAGE remoteAddr;
     INT remoteLen;
     INT pollReturn;
     BOOL rebuild;
@@ -247,13 +583,39 @@ int main(int argc, char *argv[])
 
     puts(PROGRAM_VERSION);
 
-    if (argc < 2)
+    bytesBudget = DEFAULT_BYTES_BUDGET;
+    syscallsBudget = DEFAULT_SYSCALLS_BUDGET;
+    for (argIndex = 1; argIndex + 1 < argc && argv[argIndex][0] == '-'; argIndex += 2)
+    {
+        char *end;
+        DWORD value = strtoul(argv[argIndex + 1], &end, 10);
+        if (*end != '\0' || value == 0)
+        {
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (strcmp(argv[argIndex], "-B") == 0)
+        {
+            bytesBudget = value;
+        }
+        else if (strcmp(argv[argIndex], "-S") == 0 && value >= MIN_SYSCALLS_BUDGET)
+        {
+            syscallsBudget = value;
+        }
+        else
+        {
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argIndex >= argc)
     {
         Usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    port = atoi(argv[1]);
+    port = atoi(argv[argIndex]);
 
     if (port <= 0)
     {
@@ -261,6 +623,8 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    unixSocketPath = argc > argIndex + 1 ? argv[argIndex + 1] : NULL;
+
     // Initialize Winsock
     wsaOpResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (wsaOpResult != 0)
@@ -270,42 +634,29 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // Create socket with overlapped I/O enabled.
-    listenSocket = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
-
-    if (listenSocket == INVALID_SOCKET)
-    {
-        PWError("Error creating server socket", winErrorMsgBuf);
-        return EXIT_FAILURE;
-    }
-
-    // bind and set listening
-    localAddr.sin_family = AF_INET;
-    localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    localAddr.sin_port = htons((USHORT)port);
-
-    // Set SO_REUSEADDR option to allow reuse of the address
-    BOOL bOptVal = TRUE;
-    int bOptLen = sizeof(BOOL);
-    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&bOptVal, bOptLen);
-
-    wsaOpResult = bind(listenSocket, (SOCKADDR *)&localAddr, sizeof(SOCKADDR));
-    if (wsaOpResult == SOCKET_ERROR)
+    // Create listener sockets with overlapped I/O enabled.
+    nListeners = 0;
+    listenSockets[nListeners] = CreateTcpListener(port, winErrorMsgBuf);
+    if (listenSockets[nListeners] == INVALID_SOCKET)
     {
-        PWError("Error binding server socket", winErrorMsgBuf);
+        WSACleanup();
         return EXIT_FAILURE;
     }
+    nListeners++;
 
-    wsaOpResult = listen(listenSocket, SOMAXCONN);
-    if (wsaOpResult == SOCKET_ERROR)
+    if (unixSocketPath)
     {
-        PWError("Error listening on server socket", winErrorMsgBuf);
-        return EXIT_FAILURE;
+        listenSockets[nListeners] = CreateUnixListener(unixSocketPath, winErrorMsgBuf);
+        if (listenSockets[nListeners] == INVALID_SOCKET)
+        {
+            closesocket(listenSockets[0]);
+            WSACleanup();
+            return EXIT_FAILURE;
+        }
+        nListeners++;
     }
 
-    remoteLen = sizeof(remoteAddr);
-
-    server = CreateServer(listenSocket);
+    server = CreateServer(listenSockets, nListeners, bytesBudget, syscallsBudget);
 
     rebuild = FALSE;
     finish = FALSE;
@@ -313,6 +664,10 @@ int main(int argc, char *argv[])
     SetConsoleCtrlHandler(CtrlHandler, TRUE);
 
     printf("Server listening on port %d\n", port);
+    if (unixSocketPath)
+    {
+        printf("Server listening on unix socket %s\n", unixSocketPath);
+    }
 
     while (!finish)
     {
@@ -322,13 +677,21 @@ int main(int argc, char *argv[])
             rebuild = FALSE;
         }
 
-        if ((pollReturn = WSAPoll(server->pollFds, server->nConnections, -1)) != SOCKET_ERROR)
+        // deferred connections have data waiting, so do not block while there are any.
+        if ((pollReturn = WSAPoll(server->pollFds, server->nConnections, server->nReady ? 0 : -1)) != SOCKET_ERROR)
         {
             DWORD nConnections = server->nConnections;
+            DWORD firstClient = server->firstClient;
+            DWORD nClients = nConnections - firstClient;
             INT processedEvents = 0;
 
-            for (DWORD connIndex = 0; connIndex < nConnections && processedEvents < pollReturn; connIndex++)
+            ServeReadyList(server, &rebuild, winErrorMsgBuf);
+
+            // clients are visited from a different one each pass, so low indexes are not always served first.
+            DWORD rotation = nClients ? server->pass++ % nClients : 0;
+            for (DWORD n = 0; n < nConnections && processedEvents < pollReturn; n++)
             {
+                DWORD connIndex = n < firstClient ? n : firstClient + (n - firstClient + rotation) % nClients;
                 LPWSAPOLLFD pollFd = &server->pollFds[connIndex];
                 LPCONNECTION connData = &server->connectionsData[connIndex];
 
@@ -348,7 +711,9 @@ int main(int argc, char *argv[])
                 }
                 else if ((pollFd->revents & POLLRDNORM) && (connData->type == SERVER_TYPE))
                 {
-                    SOCKET acceptSocket = WSAAccept(listenSocket, (SOCKADDR *)&remoteAddr, &remoteLen, NULL, (DWORD_PTR)NULL);
+                    ZeroMemory(&remoteAddr, sizeof(SOCKADDR_STORAGE));
+                    remoteLen = sizeof(SOCKADDR_STORAGE);
+                    SOCKET acceptSocket = WSAAccept(pollFd->fd, (SOCKADDR *)&remoteAddr, &remoteLen, NULL, (DWORD_PTR)NULL);
                     if (acceptSocket == INVALID_SOCKET)
                     {
                         SetLastError(WSAGetLastError());
@@ -356,29 +721,44 @@ int main(int argc, char *argv[])
                     }
                     else
                     {
+                        // a connection reads until the socket is empty, so it must not block.
+                        u_long nonBlocking = 1;
+                        ioctlsocket(acceptSocket, FIONBIO, &nonBlocking);
                         LPCONNECTION newConnection = RegisterConnection(server, acceptSocket, &remoteAddr, CLIENT_TYPE);
                         ServerLog(newConnection, "Accepted connection");
+
+                        // first request often arrives with the handshake: echo it now instead of next pass.
+                        // Arrays may have moved, so pollFd and connData are not valid from here.
+                        int newIndex = server->nConnections - 1;
+                        switch (EchoWithBudget(server, newIndex, winErrorMsgBuf))
+                        {
+                        case SERVE_MORE:
+                            PushReady(server, newIndex);
+                            break;
+                        case SERVE_CLOSED:
+                            UnregisterConnection(server, newIndex);
+                            rebuild = TRUE;
+                            break;
+                        default:
+                            break;
+                        }
                     }
                     processedEvents++;
                 }
                 else if (pollFd->revents & POLLRDNORM)
                 {
-                    ZeroMemory(connData->wsaBuf.buf, DATA_BUFSIZE);
-                    connData->wsaBuf.len = DATA_BUFSIZE;
-                    DWORD received = 0;
-                    DWORD flags = 0;
-
-                    if (WSARecv(pollFd->fd, &(connData->wsaBuf), 1, &received, &flags, NULL, NULL) == SOCKET_ERROR)
+                    switch (EchoWithBudget(server, connIndex, winErrorMsgBuf))
                     {
-                        ServerLog(connData, "Error fetching data: %s", StrWinError(WSAGetLastError(), winErrorMsgBuf));
-                    }
-                    else
-                    {
-                        connData->bytesReceived = received;
-                        connData->bytesSent = 0;
-                        connData->sendingState = INIT_SEND;
-                        connData->wsaBuf.len = received;
-                        pollFd->events = POLLWRNORM;
+                    case SERVE_MORE:
+                        // served again before next poll pass, after connections deferred before.
+                        PushReady(server, connIndex);
+                        break;
+                    case SERVE_CLOSED:
+                        UnregisterConnection(server, connIndex);
+                        rebuild = TRUE;
+                        break;
+                    default:
+                        break;
                     }
                     processedEvents++;
                 }
@@ -441,7 +821,12 @@ int main(int argc, char *argv[])
     }
 
     puts("Closing server...");
+    PrintFairnessStats(server);
     CloseServer(server);
+    if (unixSocketPath)
+    {
+        DeleteFileA(unixSocketPath);
+    }
     WSACleanup();
 
     return EXIT_SUCCESS;
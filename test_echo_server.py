@@ -15,27 +15,69 @@
 
     script uses aysnc IO and an event loop.
 
+    With --multiprocess, each -p worker of the echo test is a process instead of a thread, so
+    workers do not share the GIL. Workers aggregate their results in shared memory and a summary
+    with throughput and response time percentiles is printed at the end (rows only if --rows).
+
+    Besides the echo test, it runs connection scenarios (churn, flood, reset) which print a row
+    per connection and a summary with setup latency percentiles and accepted connections per second.
+
+    Pause scenario checks byte rate limited servers: readers paused by the limit must resume while
+    other connections of the same address are reset.
+
+    Replay scenario reproduces a capture recorded by a server (see c_linux_epoll/capture.h): same
+    connections, chunk sizes and timing, at captured speed, faster, or as fast as possible.
+
 """
  
 import socket
 import sys
+import errno
+import struct
 import argparse
 from argparse import RawTextHelpFormatter
 import time
 import random
 import string
 import threading
+import multiprocessing
+from multiprocessing import shared_memory
 import select
 import math
 import logging
 from datetime import datetime
 
 __author__ = "Alejandro Ambroa"
-__version__ = "1.0.0"
+__version__ = "1.2.0"
 __email__ = "jandroz@gmail.com"
 
 BUFFER_SIZE = 1024
 EXIT_FAILURE = 1
+CONNECT_TIMEOUT = 10
+# in pause scenario, a reader waiting longer than this for its echo is stalled: the server never resumed it.
+PAUSE_STALL_TIMEOUT = 10
+WSAEWOULDBLOCK = 10035
+PERCENTILES = (50, 90, 99, 99.9)
+CAPTURE_MAGIC = b'ECAP'
+CAPTURE_VERSION = 1
+CAPTURE_PAYLOADS = 0x0001
+CAPTURE_OPEN = 1
+CAPTURE_DATA = 2
+CAPTURE_CLOSE = 3
+# messages sent by each worker are taken from a pool of payloads generated before the test.
+PAYLOAD_POOL_SIZE = 256
+# response time histogram in microseconds: exact below 16 us, then 8 buckets per power of two (12.5% precision).
+LATENCY_LINEAR = 16
+LATENCY_SUB_BUCKETS = 8
+LATENCY_BUCKETS = LATENCY_LINEAR + (40 - 4 + 1) * LATENCY_SUB_BUCKETS
+# results slot of a worker: counters, then the histogram. All unsigned 64 bit.
+RESULT_MESSAGES = 0
+RESULT_BYTES = 1
+RESULT_ERRORS = 2
+RESULT_FIRST_SEND_US = 3
+RESULT_LAST_RECEIVE_US = 4
+RESULT_HISTOGRAM = 5
+RESULT_SLOT = RESULT_HISTOGRAM + LATENCY_BUCKETS
 
 program_epilog = (''
     'Table format is:'
@@ -45,7 +87,29 @@ program_epilog = (''
     '\n\n'
     'The error is marked when sent data and received data are not equals. Last column set to 1 if error occurs.'
     '\n\n'
-    'Timestamp values are Unix Time in miliseconds. Time values are in miliseconds.')
+    'Timestamp values are Unix Time in miliseconds. Time values are in miliseconds.'
+    '\n\n'
+    'Scenarios:'
+    '\n\n'
+    '  echo:  each connection is opened once and sends --num messages (default).\n'
+    '  churn: connect, one echo and close, at --rate new connections per second for --duration seconds.\n'
+    '  flood: open --connections connections in --ramp seconds, one echo each, and keep them open for --duration seconds.\n'
+    '  reset: connect, send one message and close with a reset (SO_LINGER 0) without reading the echo, like churn.\n'
+    '  pause: --connections readers echo --length bytes in a loop for --duration seconds while connections of reset scenario\n'
+    '         are opened at --rate. Against a server limiting bytes per address, readers are paused and must be resumed:\n'
+    '         a reader without its echo for %d seconds is stalled and the scenario fails.\n'
+    '  replay: replay the connections of --capture file, divided among threads. Each chunk is a row of the echo table.'
+    '\n\n'
+    'In replay scenario --speed 1 keeps captured timing, 2 replays twice as fast and 0 as fast as possible: '
+    'connections open at once and each one sends a chunk when the echo of the previous one is back. '
+    'Chunks captured without payload are filled with bytes generated from --seed, so runs are repeatable.'
+    '\n\n'
+    'In connection scenarios table format is:'
+    '\n\n'
+    'Connect timestamp,setup time,first echo time,length of data sent,length of data received,thread id,client_id,error flag (0 if no error)'
+    '\n\n'
+    'Setup time is the time until connect completes, first echo time until the echo of the first message is received '
+    '(it includes the accept of the server). A summary is printed to stderr at the end.' % (PAUSE_STALL_TIMEOUT, ))
 
 
 class EchoClient:
@@ -62,6 +126,7 @@ class EchoClient:
         self.scheduled = scheduled
         self.state = client_state
         self.data_to_send = None
+        self.data_view = None
         self.bytes_to_send = 0
         self.data_received = bytearray()
         self.bytes_sent = 0
@@ -72,6 +137,98 @@ class EchoClient:
         self.compensated_timestamp = 0
         pass
 
+class ChurnClient:
+    # states of a connection in connection scenarios.
+    CONNECTING = 0
+    SENDING = 1
+    READING = 2
+    def __init__(self, id : str, p_socket, connect_timestamp : float):
+        self.id = id
+        self.socket = p_socket
+        self.fileno = p_socket.fileno()
+        self.state = ChurnClient.CONNECTING
+        self.connect_timestamp = connect_timestamp
+        self.setup_time = 0
+        self.echo_time = 0
+        self.data_to_send = None
+        self.bytes_sent = 0
+        self.data_received = bytearray()
+
+class ChurnStats:
+    """ Results of connection scenarios, aggregated from all threads. """
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.setup_times = []
+        self.echo_times = []
+        self.completed = 0
+        self.failed = 0
+        self.first_connect = math.inf
+        self.last_completed = 0
+
+    def add(self, setup_times, echo_times, completed, failed, first_connect, last_completed):
+        with self.lock:
+            self.setup_times += setup_times
+            self.echo_times += echo_times
+            self.completed += completed
+            self.failed += failed
+            self.first_connect = min(self.first_connect, first_connect)
+            self.last_completed = max(self.last_completed, last_completed)
+
+class PauseStats(ChurnStats):
+    """ Results of pause scenario: completed are echoes of readers, failed are stalled or closed readers. """
+    def __init__(self):
+        super().__init__()
+        self.resets = 0
+
+class ReplayConnection:
+    """ Connection read from a capture. Times are seconds since capture start. """
+    def __init__(self, id : int, open_time : float):
+        self.id = id
+        self.open_time = open_time
+        self.chunks = []
+        self.close_time = None
+
+class ReplayClient:
+    # states of a replayed connection.
+    WAITING = 0
+    CONNECTING = 1
+    CONNECTED = 2
+    CLOSED = 3
+    def __init__(self, connection : ReplayConnection):
+        self.connection = connection
+        self.id = str(connection.id)
+        self.socket = None
+        self.fileno = -1
+        self.state = ReplayClient.WAITING
+        self.writing = False
+        self.next_chunk = 0
+        self.send_buffer = bytearray()
+        # bytes sent and not echoed yet.
+        self.expected = bytearray()
+        self.mismatch = False
+        # (offset in the stream where the chunk ends, send timestamp, length) of chunks waiting for their echo.
+        self.in_flight = []
+        self.sent = 0
+        self.received = 0
+
+class ReplayStats:
+    """ Results of replay scenario, aggregated from all threads. """
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latencies = []
+        self.chunks = 0
+        self.bytes = 0
+        self.errors = 0
+        self.failed = 0
+
+    def add(self, latencies, chunks, bytes, errors, failed):
+        with self.lock:
+            self.latencies += latencies
+            self.chunks += chunks
+            self.bytes += bytes
+            self.errors += errors
+            self.failed += failed
+
 class EchoDebugLogger:
     def __init__(self):
         console_handler1 = logging.StreamHandler()
@@ -85,7 +242,9 @@ class EchoDebugLogger:
         self.clientLogger.addHandler(console_handler2)
 
     def client_log(self, client: EchoClient, msg : str):
-        self.clientLogger.debug(msg, extra=client_info_to_dict(client))
+        # called several times per message: do not build the record unless it is printed.
+        if self.clientLogger.isEnabledFor(logging.DEBUG):
+            self.clientLogger.debug(msg, extra=client_info_to_dict(client))
 
     def main_log(self, msg : str):
         self.mainLogger.debug(msg)
@@ -128,6 +287,12 @@ class SelectableEngineSelect(Selectable):
     def remove_output(self, s):
         self.outputs.remove(s)
 
+    def remove(self, s):
+        if s in self.inputs:
+            self.inputs.remove(s)
+        if s in self.outputs:
+            self.outputs.remove(s)
+
     def get_fileno(self, s):
         return s.fileno()
 
@@ -158,11 +323,15 @@ class SelectableEnginePoll(Selectable):
     def remove_output(self, s):
         self.poller.modify(s, self.READ_ONLY)
 
+    def remove(self, s):
+        self.poller.unregister(s)
+
     def get_fileno(self, s):
         return s
 
     def select(self, timeout):
-        events = self.poller.poll(timeout)
+        # select() timeout is in seconds, poll() one in miliseconds.
+        events = self.poller.poll(None if timeout is None else timeout * 1000)
         self.inputs.clear()
         self.outputs.clear()
         self.exceptions.clear()
@@ -190,12 +359,126 @@ class SelectableEngineFactory:
         return engine
 
 
-def print_table_row(send_timestamp, finish_send_timestamp, response_time, data_sent_length, data_received_length, thread_id, client_id, error):
-    print('%d,%d,%d,%d,%d,%d,%s,%i' % (send_timestamp * 1000, finish_send_timestamp * 1000, 
-                    response_time * 1000, data_sent_length, data_received_length, thread_id, client_id, 1 if error else 0))
+def format_table_row(send_timestamp, finish_send_timestamp, response_time, data_sent_length, data_received_length, thread_id, client_id, error):
+    return '%d,%d,%d,%d,%d,%d,%s,%i' % (send_timestamp * 1000, finish_send_timestamp * 1000,
+                    response_time * 1000, data_sent_length, data_received_length, thread_id, client_id, 1 if error else 0)
 
-def connect_echo_client(client, host, port):
-    client.socket.connect((host, port))
+def print_table_row(send_timestamp, finish_send_timestamp, response_time, data_sent_length, data_received_length, thread_id, client_id, error):
+    print(format_table_row(send_timestamp, finish_send_timestamp, response_time, data_sent_length, data_received_length,
+                           thread_id, client_id, error))
+
+def print_churn_row(connect_timestamp, setup_time, echo_time, data_sent_length, data_received_length, thread_id, client_id, error):
+    print('%d,%.3f,%.3f,%d,%d,%d,%s,%i' % (connect_timestamp * 1000, setup_time * 1000, echo_time * 1000,
+                    data_sent_length, data_received_length, thread_id, client_id, 1 if error else 0))
+
+def generate_data(data_length):
+    return bytearray(''.join([random.choice(string.ascii_uppercase) for i in range(0, data_length - 1)]), 'utf-8') + b'\n'
+
+def generate_payload_pool(data_length):
+    return [bytes(generate_data(data_length)) for i in range(0, PAYLOAD_POOL_SIZE)]
+
+def latency_bucket(us):
+    if us < LATENCY_LINEAR:
+        return us
+    exponent = us.bit_length() - 1
+    index = LATENCY_LINEAR + (exponent - 4) * LATENCY_SUB_BUCKETS + ((us >> (exponent - 3)) & (LATENCY_SUB_BUCKETS - 1))
+    return min(index, LATENCY_BUCKETS - 1)
+
+def bucket_latency(index):
+    # middle of the bucket, in microseconds.
+    if index < LATENCY_LINEAR:
+        return index
+    exponent = (index - LATENCY_LINEAR) // LATENCY_SUB_BUCKETS + 4
+    sub_bucket = (index - LATENCY_LINEAR) % LATENCY_SUB_BUCKETS
+    return ((LATENCY_SUB_BUCKETS + sub_bucket) << (exponent - 3)) + (1 << (exponent - 3)) / 2
+
+def add_result(results, slot, send_timestamp, received_timestamp, response_time, length, error):
+    base = slot * RESULT_SLOT
+    results[base + RESULT_MESSAGES] += 1
+    results[base + RESULT_BYTES] += length
+    results[base + RESULT_ERRORS] += 1 if error else 0
+    if not results[base + RESULT_FIRST_SEND_US]:
+        results[base + RESULT_FIRST_SEND_US] = int(send_timestamp * 1e6)
+    results[base + RESULT_LAST_RECEIVE_US] = int(received_timestamp * 1e6)
+    results[base + RESULT_HISTOGRAM + latency_bucket(max(0, int(response_time * 1e6)))] += 1
+
+def percentile(sorted_values, p):
+    # nearest rank.
+    if not sorted_values:
+        return 0
+    return sorted_values[min(len(sorted_values) - 1, max(0, math.ceil(p / 100.0 * len(sorted_values)) - 1))]
+
+def latency_summary(values):
+    values = sorted(values)
+    if not values:
+        return 'no samples'
+    return ' '.join(['p%g %.3f' % (p, percentile(values, p) * 1000) for p in PERCENTILES] + ['max %.3f' % (values[-1] * 1000, )])
+
+def read_varint(data, offset):
+    value = shift = 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, offset
+
+def load_capture(path, seed):
+    """ Returns the connections of a capture, ordered by id. Missing payloads are generated from seed. """
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    if len(data) < 16:
+        raise ValueError('capture is too short')
+    magic, version, flags, _ = struct.unpack_from('<4sHHQ', data, 0)
+    if magic != CAPTURE_MAGIC or version != CAPTURE_VERSION:
+        raise ValueError('not a capture file or unsupported version')
+
+    connections = {}
+    offset = 16
+    now = 0
+    try:
+        while offset < len(data):
+            record_type = data[offset]
+            delta, offset = read_varint(data, offset + 1)
+            connection_id, offset = read_varint(data, offset)
+            now += delta
+            if record_type == CAPTURE_OPEN:
+                connections[connection_id] = ReplayConnection(connection_id, now / 1e6)
+            elif record_type == CAPTURE_DATA:
+                length, offset = read_varint(data, offset)
+                payload = None
+                if flags & CAPTURE_PAYLOADS:
+                    payload = data[offset:offset + length]
+                    offset += length
+                if connection_id in connections:
+                    connections[connection_id].chunks.append([now / 1e6, length, payload])
+            elif record_type == CAPTURE_CLOSE:
+                if connection_id in connections:
+                    connections[connection_id].close_time = now / 1e6
+            else:
+                raise ValueError('unknown record type %d' % (record_type, ))
+    except IndexError:
+        # server was killed while writing. Keep the complete records.
+        print_error('Capture is truncated at offset %d' % (offset, ))
+
+    # each connection has its own generator, so its bytes do not depend on how connections are divided among threads.
+    alphabet = string.ascii_uppercase.encode()
+    for connection in connections.values():
+        rng = random.Random('%d-%d' % (seed, connection.id))
+        for chunk in connection.chunks:
+            if chunk[2] is None or len(chunk[2]) != chunk[1]:
+                chunk[2] = bytes(rng.choices(alphabet, k=chunk[1]))
+    return [connections[k] for k in sorted(connections)]
+
+def reset_socket(s):
+    # linger is two u_short on Windows.
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('HH' if sys.platform == 'win32' else 'ii', 1, 0))
+    s.close()
+
+def connect_echo_client(client, address):
+    client.socket.connect(address)
     client.socket.setblocking(0)
     client.state = EchoClient.READY
 
@@ -215,18 +498,26 @@ def client_info_to_dict(client : EchoClient):
 def print_error(msg : str):
     print(msg, file=sys.stderr)
     
-def test_echo(logger, host, port, max_messages, data_length, min_interval, max_interval, sockets_by_thread):
+def test_echo(logger, host, port, max_messages, data_length, min_interval, max_interval, sockets_by_thread, results, slot, rows):
 
+    # rows: None prints each row when the echo is received, a list collects them and False drops them.
     thread_id = threading.get_native_id()
 
+    # generating a payload per message would be measured as server latency.
+    payloads = generate_payload_pool(data_length)
+    payload_index = 0
+
     selectable_wrapper = SelectableEngineFactory.build()
     clients = {}
 
+    # resolve once so IPv6 hosts work too.
+    family, _, _, _, address = socket.getaddrinfo(host, port, type=socket.SOCK_STREAM)[0]
+
     # create clients and schedule.
     t1 = time.time()
     schedule = t1
     for sock_index in range(0, sockets_by_thread):
-        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s = socket.socket(family, socket.SOCK_STREAM)
         client = EchoClient(str(sock_index), s, EchoClient.INIT, schedule)
         clients[s.fileno()] = client
         logger.client_log(client, 'Client created.')
@@ -249,7 +540,7 @@ def test_echo(logger, host, port, max_messages, data_length, min_interval, max_i
             else:
                 if echo_client.scheduled <= current_time:
                     if echo_client.state == EchoClient.INIT:
-                        connect_echo_client(echo_client, host, port)
+                        connect_echo_client(echo_client, address)
                         selectable_wrapper.add_input_output(echo_client.socket)
                         logger.client_log(echo_client, 'Client connected.')
                     elif echo_client.state == EchoClient.READY:
@@ -293,24 +584,33 @@ def test_echo(logger, host, port, max_messages, data_length, min_interval, max_i
                 
                 # here prints result table rows.
                 response_time = received_timestamp - echo_client.send_timestamp - echo_client.compensated_timestamp
-                print_table_row(echo_client.send_timestamp, received_timestamp, response_time, 
-                                echo_client.bytes_sent, length_data_received, 
-                                thread_id, echo_client.id, 
-                                echo_client.data_received != echo_client.data_to_send)
+                error = echo_client.data_received != echo_client.data_to_send
+                add_result(results, slot, echo_client.send_timestamp, received_timestamp, response_time,
+                           echo_client.bytes_sent, error)
+                if rows is None:
+                    print_table_row(echo_client.send_timestamp, received_timestamp, response_time,
+                                    echo_client.bytes_sent, length_data_received,
+                                    thread_id, echo_client.id, error)
+                elif rows is not False:
+                    rows.append(format_table_row(echo_client.send_timestamp, received_timestamp, response_time,
+                                                 echo_client.bytes_sent, length_data_received,
+                                                 thread_id, echo_client.id, error))
                 echo_client.data_received.clear()
 
         for writable_socket in writable:
             echo_client = clients[selectable_wrapper.get_fileno(writable_socket)]
             if echo_client.state == EchoClient.READY:
-                echo_client.data_to_send = bytearray(''.join([random.choice(string.ascii_uppercase) 
-                                                          for i in range(0, data_length - 1)]), 'utf-8') + b'\n'
+                echo_client.data_to_send = payloads[payload_index]
+                payload_index = (payload_index + 1) % PAYLOAD_POOL_SIZE
+                echo_client.data_view = memoryview(echo_client.data_to_send)
                 echo_client.bytes_to_send = len(echo_client.data_to_send)
                 echo_client.bytes_sent = 0
                 echo_client.send_timestamp = time.time()
                 echo_client.last_send_timestamp = echo_client.compensated_timestamp = 0
                 echo_client.state = EchoClient.SENDING
             
-            sent = echo_client.socket.send(echo_client.data_to_send[echo_client.bytes_sent:])
+            # a view does not copy what remains of a partial send.
+            sent = echo_client.socket.send(echo_client.data_view[echo_client.bytes_sent:])
             echo_client.last_send_timestamp = time.time()
             echo_client.bytes_sent += sent
             logger.client_log(echo_client, 'Client sends data')
@@ -332,6 +632,443 @@ def test_echo(logger, host, port, max_messages, data_length, min_interval, max_i
 
     print('Tests completed by thread: %d' % (thread_id, ), file=sys.stderr)
 
+def test_echo_process(shm_name, slot, rows_lock, print_rows, host, port, max_messages, data_length,
+                      min_interval, max_interval, sockets_by_thread):
+    """ Echo test worker of multiprocess mode. Results go to its slot of the shared memory block. """
+    logging.basicConfig(level=logging.INFO, handlers=[])
+    shm = shared_memory.SharedMemory(name=shm_name)
+    results = shm.buf.cast('Q')
+    rows = [] if print_rows else False
+    try:
+        test_echo(EchoDebugLogger(), host, port, max_messages, data_length, min_interval, max_interval,
+                  sockets_by_thread, results, slot, rows)
+    finally:
+        results.release()
+        shm.close()
+
+    # rows are written at the end, one process at a time, so lines of several processes are not mixed.
+    if rows:
+        with rows_lock:
+            sys.stdout.write('\n'.join(rows) + '\n')
+            sys.stdout.flush()
+
+def print_echo_summary(results, workers, elapsed):
+    histogram = [0] * LATENCY_BUCKETS
+    messages = total_bytes = errors = 0
+    first_send = math.inf
+    last_receive = 0
+    for slot in range(0, workers):
+        base = slot * RESULT_SLOT
+        messages += results[base + RESULT_MESSAGES]
+        total_bytes += results[base + RESULT_BYTES]
+        errors += results[base + RESULT_ERRORS]
+        if results[base + RESULT_FIRST_SEND_US]:
+            first_send = min(first_send, results[base + RESULT_FIRST_SEND_US] / 1e6)
+        last_receive = max(last_receive, results[base + RESULT_LAST_RECEIVE_US] / 1e6)
+        for i in range(0, LATENCY_BUCKETS):
+            histogram[i] += results[base + RESULT_HISTOGRAM + i]
+
+    # throughput counts from the first send to the last echo, not connection setup and teardown.
+    echo_elapsed = max(last_receive - first_send, 1e-6) if messages else 0
+    print('Echo: %d messages, %d bytes, %d errors in %.2f s' % (messages, total_bytes, errors, elapsed), file=sys.stderr)
+    if not messages:
+        return
+    print('Throughput: %.1f messages/s, %.1f KB/s' % (messages / echo_elapsed, total_bytes / 1024 / echo_elapsed), file=sys.stderr)
+
+    summary = []
+    count = 0
+    percentiles = list(PERCENTILES)
+    for i in range(0, LATENCY_BUCKETS):
+        count += histogram[i]
+        while percentiles and count >= math.ceil(percentiles[0] / 100.0 * messages):
+            summary.append('p%g %.3f' % (percentiles.pop(0), bucket_latency(i) / 1000))
+        if histogram[i]:
+            highest = i
+    summary.append('max %.3f' % (bucket_latency(highest) / 1000, ))
+    print('Response time (ms): %s' % (' '.join(summary), ), file=sys.stderr)
+
+def test_churn(logger, host, port, scenario, data_length, rate, duration, connections, ramp, stats):
+
+    thread_id = threading.get_native_id()
+
+    selectable_wrapper = SelectableEngineFactory.build()
+    clients = {}
+    held = []
+    setup_times = []
+    echo_times = []
+    completed = failed = 0
+
+    family, _, _, _, address = socket.getaddrinfo(host, port, type=socket.SOCK_STREAM)[0]
+
+    # flood opens all connections during the ramp. Churn and reset open them at a fixed rate.
+    if scenario == 'flood':
+        total = connections
+        interval = ramp / connections
+    else:
+        total = int(rate * duration)
+        interval = 1.0 / rate
+
+    first_connect = time.time()
+    last_completed = first_connect
+    next_connect = first_connect
+    created = 0
+
+    def finish_client(client, error):
+        nonlocal completed, failed, last_completed
+        print_churn_row(client.connect_timestamp, client.setup_time, client.echo_time,
+                        client.bytes_sent, len(client.data_received), thread_id, client.id, error)
+        selectable_wrapper.remove(client.socket)
+        del clients[client.fileno]
+        if error:
+            failed += 1
+            client.socket.close()
+        else:
+            completed += 1
+            last_completed = time.time()
+
+    while created < total or clients:
+        current_time = time.time()
+
+        # new connections are scheduled in advance, so a slow server does not lower the rate.
+        while created < total and next_connect <= current_time:
+            s = socket.socket(family, socket.SOCK_STREAM)
+            s.setblocking(False)
+            client = ChurnClient(str(created), s, time.time())
+            created += 1
+            next_connect += interval
+            result = s.connect_ex(address)
+            clients[client.fileno] = client
+            selectable_wrapper.add_input_output(s)
+            if result not in (0, errno.EINPROGRESS, errno.EWOULDBLOCK, WSAEWOULDBLOCK):
+                finish_client(client, True)
+            else:
+                logger.main_log('Client %s connecting.' % (client.id, ))
+
+        for client in [c for c in clients.values() if current_time - c.connect_timestamp > CONNECT_TIMEOUT]:
+            print_error('Timeout in client %s' % (client.id, ))
+            finish_client(client, True)
+
+        if not clients:
+            if created < total:
+                time.sleep(max(0, next_connect - time.time()))
+            continue
+
+        wait_interval = None if created >= total else max(0, next_connect - time.time())
+        readable, writable, exceptional = selectable_wrapper.select(wait_interval)
+        event_time = time.time()
+
+        for socket_exception in exceptional:
+            client = clients.get(selectable_wrapper.get_fileno(socket_exception))
+            if client:
+                finish_client(client, True)
+
+        for writable_socket in writable:
+            client = clients.get(selectable_wrapper.get_fileno(writable_socket))
+            if not client:
+                continue
+            if client.state == ChurnClient.CONNECTING:
+                if client.socket.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR) != 0:
+                    finish_client(client, True)
+                    continue
+                client.setup_time = event_time - client.connect_timestamp
+                setup_times.append(client.setup_time)
+                client.data_to_send = generate_data(data_length)
+                client.state = ChurnClient.SENDING
+            try:
+                client.bytes_sent += client.socket.send(client.data_to_send[client.bytes_sent:])
+            except (BlockingIOError, InterruptedError):
+                continue
+            except OSError:
+                finish_client(client, True)
+                continue
+            if client.bytes_sent == len(client.data_to_send):
+                if scenario == 'reset':
+                    # echo is not read: server finds the connection reset while it is echoing.
+                    finish_client(client, False)
+                    reset_socket(client.socket)
+                else:
+                    client.state = ChurnClient.READING
+                    selectable_wrapper.remove_output(client.socket)
+
+        for readable_socket in readable:
+            client = clients.get(selectable_wrapper.get_fileno(readable_socket))
+            if not client or client.state != ChurnClient.READING:
+                continue
+            try:
+                recv_data = client.socket.recv(BUFFER_SIZE)
+            except (BlockingIOError, InterruptedError):
+                continue
+            except OSError:
+                recv_data = b''
+            if not recv_data:
+                # closed or reset by server, i.e. rejected by admission control.
+                finish_client(client, True)
+                continue
+            client.data_received += recv_data
+            if len(client.data_received) >= len(client.data_to_send):
+                client.echo_time = time.time() - client.connect_timestamp
+                echo_times.append(client.echo_time)
+                error = client.data_received != client.data_to_send
+                finish_client(client, error)
+                if not error:
+                    if scenario == 'flood':
+                        held.append(client.socket)
+                    else:
+                        client.socket.close()
+
+    stats.add(setup_times, echo_times, completed, failed, first_connect, last_completed)
+
+    if held:
+        time.sleep(duration)
+        for s in held:
+            s.close()
+
+    print('Tests completed by thread: %d' % (thread_id, ), file=sys.stderr)
+
+def test_pause(logger, host, port, data_length, rate, duration, connections, stats):
+
+    thread_id = threading.get_native_id()
+    family, _, _, _, address = socket.getaddrinfo(host, port, type=socket.SOCK_STREAM)[0]
+    echo_times = []
+    completed = failed = resets = 0
+
+    # readers are blocking: a paused reader waits in recv until the server resumes it.
+    readers = []
+    for i in range(0, connections):
+        s = socket.socket(family, socket.SOCK_STREAM)
+        s.settimeout(PAUSE_STALL_TIMEOUT)
+        try:
+            s.connect(address)
+        except OSError as e:
+            print_error('Error connecting reader %d: %s' % (i, e))
+            failed += 1
+            s.close()
+            continue
+        readers.append(s)
+
+    first_echo = time.time()
+    last_echo = first_echo
+    next_reset = first_echo
+    end = first_echo + duration
+    while readers and time.time() < end:
+        # resets are sent between echoes. The server reads the message, goes into debt with the address and
+        # finds the connection reset when it echoes, while readers of the same address are paused.
+        while next_reset <= time.time():
+            next_reset += 1.0 / rate
+            s = socket.socket(family, socket.SOCK_STREAM)
+            try:
+                s.connect(address)
+                s.sendall(generate_data(data_length))
+                reset_socket(s)
+                resets += 1
+            except OSError:
+                s.close()
+        for i, s in enumerate(list(readers)):
+            data = generate_data(data_length)
+            send_timestamp = time.time()
+            received = bytearray()
+            try:
+                s.sendall(data)
+                while len(received) < len(data):
+                    recv_data = s.recv(BUFFER_SIZE)
+                    if not recv_data:
+                        break
+                    received += recv_data
+            except socket.timeout:
+                print_error('Reader %d stalled: no echo in %d seconds' % (i, PAUSE_STALL_TIMEOUT))
+            except OSError as e:
+                print_error('Error in reader %d: %s' % (i, e))
+            if received != data:
+                failed += 1
+                readers.remove(s)
+                s.close()
+                continue
+            last_echo = time.time()
+            echo_times.append(last_echo - send_timestamp)
+            completed += 1
+
+    for s in readers:
+        s.close()
+    stats.add([], echo_times, completed, failed, first_echo, last_echo)
+    with stats.lock:
+        stats.resets += resets
+    print('Tests completed by thread: %d' % (thread_id, ), file=sys.stderr)
+
+def test_replay(logger, host, port, connections, speed, start, stats):
+
+    thread_id = threading.get_native_id()
+
+    selectable_wrapper = SelectableEngineFactory.build()
+    pending = [ReplayClient(c) for c in connections]
+    clients = {}
+    latencies = []
+    chunks = replayed_bytes = errors = failed = 0
+
+    family, _, _, _, address = socket.getaddrinfo(host, port, type=socket.SOCK_STREAM)[0]
+
+    def due(capture_time):
+        # as fast as possible: everything is due, chunks are paced by their echoes instead.
+        return start if speed == 0 else start + capture_time / speed
+
+    def set_writing(client, writing):
+        if client.writing != writing:
+            selectable_wrapper.remove(client.socket)
+            if writing:
+                selectable_wrapper.add_input_output(client.socket)
+            else:
+                selectable_wrapper.add_input(client.socket)
+            client.writing = writing
+
+    def finish_client(client, error):
+        nonlocal failed
+        if error:
+            failed += 1
+            print_error('Replay of connection %s failed after %d of %d chunks' %
+                        (client.id, client.next_chunk - len(client.in_flight), len(client.connection.chunks)))
+        selectable_wrapper.remove(client.socket)
+        del clients[client.fileno]
+        client.socket.close()
+        client.state = ReplayClient.CLOSED
+
+    def flush(client):
+        try:
+            sent = client.socket.send(client.send_buffer)
+        except (BlockingIOError, InterruptedError):
+            sent = 0
+        except OSError:
+            finish_client(client, True)
+            return
+        del client.send_buffer[:sent]
+        set_writing(client, len(client.send_buffer) > 0)
+
+    while pending or clients:
+        current_time = time.time()
+        next_time = math.inf
+
+        while pending and due(pending[0].connection.open_time) <= current_time:
+            client = pending.pop(0)
+            client.socket = socket.socket(family, socket.SOCK_STREAM)
+            client.socket.setblocking(False)
+            client.fileno = client.socket.fileno()
+            client.state = ReplayClient.CONNECTING
+            client.writing = True
+            clients[client.fileno] = client
+            selectable_wrapper.add_input_output(client.socket)
+            result = client.socket.connect_ex(address)
+            if result not in (0, errno.EINPROGRESS, errno.EWOULDBLOCK, WSAEWOULDBLOCK):
+                finish_client(client, True)
+            else:
+                logger.main_log('Client %s connecting.' % (client.id, ))
+        if pending:
+            next_time = due(pending[0].connection.open_time)
+
+        for client in list(clients.values()):
+            if client.state != ReplayClient.CONNECTED:
+                continue
+            connection = client.connection
+            queued = False
+            while client.next_chunk < len(connection.chunks):
+                capture_time, length, payload = connection.chunks[client.next_chunk]
+                chunk_time = due(capture_time)
+                if chunk_time > current_time or (speed == 0 and client.in_flight):
+                    if speed != 0:
+                        next_time = min(next_time, chunk_time)
+                    break
+                client.send_buffer += payload
+                client.expected += payload
+                client.sent += length
+                client.in_flight.append((client.sent, current_time, length))
+                client.next_chunk += 1
+                queued = True
+            if queued and not client.writing:
+                flush(client)
+            if client.next_chunk == len(connection.chunks) and not client.in_flight:
+                # connections still open at the end of the capture are closed once replayed.
+                close_time = due(connection.close_time if connection.close_time is not None else 0)
+                if close_time <= current_time:
+                    finish_client(client, False)
+                else:
+                    next_time = min(next_time, close_time)
+
+        if not clients:
+            if pending:
+                time.sleep(max(0, next_time - time.time()))
+            continue
+
+        wait_interval = None if next_time == math.inf else max(0, next_time - time.time())
+        readable, writable, exceptional = selectable_wrapper.select(wait_interval)
+
+        for writable_socket in writable:
+            client = clients.get(selectable_wrapper.get_fileno(writable_socket))
+            if not client:
+                continue
+            if client.state == ReplayClient.CONNECTING:
+                if client.socket.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR) != 0:
+                    finish_client(client, True)
+                    continue
+                client.state = ReplayClient.CONNECTED
+                logger.main_log('Client %s connected.' % (client.id, ))
+            flush(client)
+
+        for readable_socket in readable:
+            client = clients.get(selectable_wrapper.get_fileno(readable_socket))
+            if not client or client.state != ReplayClient.CONNECTED:
+                continue
+            try:
+                recv_data = client.socket.recv(BUFFER_SIZE * 64)
+            except (BlockingIOError, InterruptedError):
+                continue
+            except OSError:
+                recv_data = b''
+            if not recv_data:
+                finish_client(client, True)
+                continue
+            received_timestamp = time.time()
+            # echoed bytes are checked against what was sent, then dropped.
+            if client.expected[:len(recv_data)] != recv_data:
+                client.mismatch = True
+            del client.expected[:len(recv_data)]
+            client.received += len(recv_data)
+            while client.in_flight and client.in_flight[0][0] <= client.received:
+                _, send_timestamp, length = client.in_flight.pop(0)
+                latencies.append(received_timestamp - send_timestamp)
+                chunks += 1
+                replayed_bytes += length
+                errors += 1 if client.mismatch else 0
+                print_table_row(send_timestamp, received_timestamp, received_timestamp - send_timestamp,
+                                length, length, thread_id, client.id, client.mismatch)
+                client.mismatch = False
+
+        for socket_exception in exceptional:
+            client = clients.get(selectable_wrapper.get_fileno(socket_exception))
+            if client and client.state == ReplayClient.CONNECTING:
+                finish_client(client, True)
+
+    stats.add(latencies, chunks, replayed_bytes, errors, failed)
+
+    print('Tests completed by thread: %d' % (thread_id, ), file=sys.stderr)
+
+def print_replay_summary(connections, speed, stats, elapsed):
+    capture_duration = max([c.close_time or (c.chunks[-1][0] if c.chunks else c.open_time) for c in connections] + [0])
+    print('Replay of %d connections (%.2f s captured) at %s: %d chunks, %d bytes in %.2f s, %d failed connections, %d errors' %
+          (len(connections), capture_duration, 'full speed' if speed == 0 else '%gx' % (speed, ),
+           stats.chunks, stats.bytes, elapsed, stats.failed, stats.errors), file=sys.stderr)
+    print('Echo time (ms): %s' % (latency_summary(stats.latencies), ), file=sys.stderr)
+
+def print_pause_summary(stats, elapsed):
+    print('Scenario pause: %d echoes, %d failed readers, %d resets in %.2f s' % (stats.completed, stats.failed, stats.resets, elapsed),
+          file=sys.stderr)
+    print('Echo time (ms): %s' % (latency_summary(stats.echo_times), ), file=sys.stderr)
+
+def print_churn_summary(scenario, stats, elapsed):
+    # a connection is accepted when its echo is received (sent, in reset scenario). Rejected ones fail.
+    accept_elapsed = max(stats.last_completed - stats.first_connect, 1e-6)
+    print('Scenario %s: %d connections completed, %d failed in %.2f s' % (scenario, stats.completed, stats.failed, elapsed), file=sys.stderr)
+    print('Accepted connections/s: %.1f' % (stats.completed / accept_elapsed, ), file=sys.stderr)
+    print('Setup time (ms): %s' % (latency_summary(stats.setup_times), ), file=sys.stderr)
+    if scenario != 'reset':
+        print('First echo time (ms): %s' % (latency_summary(stats.echo_times), ), file=sys.stderr)
+
 if __name__ == '__main__':
 
     logging.basicConfig(level=logging.INFO, handlers=[])
@@ -352,7 +1089,26 @@ if __name__ == '__main__':
                         ' Script selects a random number between min and max')
     parser.add_argument('-n', '--num', type=int, required=False, default=100, help='Num messages to send')
     parser.add_argument('-p', '--threads', type=int, required=False, default=1, help='Num. of threads')
-    parser.add_argument('-c', '--connections', type=int, required=False, default=1, help='Connections by thread.')
+    parser.add_argument('-c', '--connections', type=int, required=False, default=1,
+                        help='Connections by thread. In flood scenario, connections to open by thread. In pause scenario, readers by thread.')
+    parser.add_argument('-s', '--scenario', type=str, required=False, default='echo', choices=['echo', 'churn', 'flood', 'reset', 'pause', 'replay'],
+                        help='Test scenario (see below).')
+    parser.add_argument('-r', '--rate', type=float, required=False, default=100,
+                        help='New connections per second by thread, in churn, reset and pause scenarios.')
+    parser.add_argument('-d', '--duration', type=float, required=False, default=10,
+                        help='Seconds opening connections in churn, reset and pause scenarios, or keeping them open in flood scenario.')
+    parser.add_argument('--ramp', type=float, required=False, default=5,
+                        help='Seconds to open all connections in flood scenario.')
+    parser.add_argument('--capture', type=str, required=False,
+                        help='Capture file to replay in replay scenario.')
+    parser.add_argument('--speed', type=float, required=False, default=1,
+                        help='Replay speed: 1 keeps captured timing, N is N times faster, 0 as fast as possible.')
+    parser.add_argument('--seed', type=int, required=False, default=0,
+                        help='Seed of the bytes sent in chunks captured without payload.')
+    parser.add_argument('-m', '--multiprocess', action='store_true',
+                        help='In echo scenario, run each of the -p workers in its own process instead of a thread.')
+    parser.add_argument('--rows', action='store_true',
+                        help='In multiprocess mode, print a table row per message too. Otherwise only the summary is printed.')
    
 
     args = parser.parse_args()
@@ -377,6 +1133,18 @@ if __name__ == '__main__':
         print_error('Connections number must be greather than 0')
         exit(EXIT_FAILURE)
 
+    if args.rate <= 0 or args.duration < 0 or args.ramp < 0:
+        print_error('Rate must be greater than 0, duration and ramp can not be negative')
+        exit(EXIT_FAILURE)
+
+    if args.scenario == 'replay' and (not args.capture or args.speed < 0):
+        print_error('Replay scenario needs a --capture file and a speed of 0 or more')
+        exit(EXIT_FAILURE)
+
+    if args.multiprocess and args.scenario != 'echo':
+        print_error('Multiprocess mode is only available in echo scenario')
+        exit(EXIT_FAILURE)
+
     min_interval = max_interval = 0
 
     try:
@@ -395,8 +1163,82 @@ if __name__ == '__main__':
         print_error('max interval must be greather or equal than min interval')
         exit(EXIT_FAILURE)
 
-    for i in range(0, args.threads):
-        pt = threading.Thread(target=test_echo, args=(logger, args.host, args.port, args.num, 
-                                                args.length, min_interval, max_interval, args.connections))
-        pt.start()
+    if args.scenario == 'replay':
+        try:
+            connections = load_capture(args.capture, args.seed)
+        except (OSError, ValueError) as e:
+            print_error('Error loading capture: %s' % (e, ))
+            exit(EXIT_FAILURE)
+        stats = ReplayStats()
+        threads = []
+        # all threads share the same start, so connections of different threads keep their captured offsets.
+        start = time.time() + 0.1
+        for i in range(0, args.threads):
+            pt = threading.Thread(target=test_replay, args=(logger, args.host, args.port, connections[i::args.threads],
+                                                            args.speed, start, stats))
+            pt.start()
+            threads.append(pt)
+        for pt in threads:
+            pt.join()
+        print_replay_summary(connections, args.speed, stats, time.time() - start)
+    elif args.scenario == 'pause':
+        stats = PauseStats()
+        threads = []
+        start = time.time()
+        for i in range(0, args.threads):
+            pt = threading.Thread(target=test_pause, args=(logger, args.host, args.port, args.length, args.rate,
+                                                           args.duration, args.connections, stats))
+            pt.start()
+            threads.append(pt)
+        for pt in threads:
+            pt.join()
+        print_pause_summary(stats, time.time() - start)
+        if stats.failed:
+            exit(EXIT_FAILURE)
+    elif args.scenario == 'echo' and args.multiprocess:
+        # one results slot per process. Each process only writes its own slot.
+        shm = shared_memory.SharedMemory(create=True, size=args.threads * RESULT_SLOT * 8)
+        results = shm.buf.cast('Q')
+        for i in range(0, len(results)):
+            results[i] = 0
+        rows_lock = multiprocessing.Lock()
+        processes = []
+        start = time.time()
+        for i in range(0, args.threads):
+            pp = multiprocessing.Process(target=test_echo_process, args=(shm.name, i, rows_lock, args.rows, args.host, args.port,
+                                                                         args.num, args.length, min_interval, max_interval,
+                                                                         args.connections))
+            pp.start()
+            processes.append(pp)
+        for pp in processes:
+            pp.join()
+        print_echo_summary(results, args.threads, time.time() - start)
+        results.release()
+        shm.close()
+        shm.unlink()
+    elif args.scenario == 'echo':
+        results = memoryview(bytearray(args.threads * RESULT_SLOT * 8)).cast('Q')
+        threads = []
+        start = time.time()
+        for i in range(0, args.threads):
+            pt = threading.Thread(target=test_echo, args=(logger, args.host, args.port, args.num,
+                                                    args.length, min_interval, max_interval, args.connections,
+                                                    results, i, None))
+            pt.start()
+            threads.append(pt)
+        for pt in threads:
+            pt.join()
+        print_echo_summary(results, args.threads, time.time() - start)
+    else:
+        stats = ChurnStats()
+        threads = []
+        start = time.time()
+        for i in range(0, args.threads):
+            pt = threading.Thread(target=test_churn, args=(logger, args.host, args.port, args.scenario, args.length,
+                                                           args.rate, args.duration, args.connections, args.ramp, stats))
+            pt.start()
+            threads.append(pt)
+        for pt in threads:
+            pt.join()
+        print_churn_summary(args.scenario, stats, time.time() - start)
     